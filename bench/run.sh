@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# Generates a synthetic URF corpus and benchmarks urftopdf on it:
+#   decode    header parsing, pre-scan and decoding of the raster
+#   compress  image compression of the decoded pages
+#   urftopdf-<backend>  whole conversions, one per PDF backend
+#
+# BENCH_DPI, BENCH_PAGES, BENCH_RUNS and BENCH_OPTIONS (job options as
+# given to the filter, e.g. "urf-threads=4") tune the run.
+
+BENCH_DIR=${BENCH_DIR:-bench/corpus}
+BENCH_DPI=${BENCH_DPI:-"300 600"}
+BENCH_PAGES=${BENCH_PAGES:-2}
+BENCH_RUNS=${BENCH_RUNS:-3}
+BENCH_BACKENDS=${BENCH_BACKENDS:-"hpdf qpdf stream"}
+
+set -e
+
+mkdir -p $BENCH_DIR
+
+files=""
+for dpi in $BENCH_DPI
+do
+    # kind:bpp, 8 bpp is gray, 32 bpp CMYK, 24 and 64 bpp RGB
+    for page in text:8 text:24 photo:24 photo:32 photo:64 blank:24 grayrgb:24
+    do
+        kind=${page%:*}
+        bpp=${page#*:}
+        file=$BENCH_DIR/$kind-${bpp}bpp-${dpi}dpi-${BENCH_PAGES}p.urf
+        if [ ! -f $file ]
+        then
+            ./bench/urfgen $file $kind $bpp $dpi $BENCH_PAGES
+        fi
+        files="$files $file"
+    done
+done
+
+binaries=""
+for backend in $BENCH_BACKENDS
+do
+    binaries="$binaries -b ./urftopdf-$backend"
+done
+
+# Keep the filter messages out of the results
+if ! ./bench/urfbench -r $BENCH_RUNS -o "$BENCH_OPTIONS" $binaries $files 2> $BENCH_DIR/urfbench.log
+then
+    grep -v '^INFO: ' $BENCH_DIR/urfbench.log >&2
+    exit 1
+fi
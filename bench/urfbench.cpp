@@ -0,0 +1,291 @@
+/**
+ * This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @brief Benchmark the urftopdf stages and whole conversions
+ * @file urfbench.cpp
+ */
+
+#define URFTOPDF_NO_MAIN
+#include "../urftopdf.cpp"
+
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+
+/*
+ * Throughputs are given in MB of raster, as stored in the URF pages
+ * (width x height x bpp), so they compare across page contents.
+ */
+struct bench_result
+{
+    double seconds;
+    unsigned pages;
+    uint64_t raster_bytes;
+    uint64_t output_bytes;   // compressed image data, 0 if not measured
+    long peak_rss;           // KB
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static long self_peak_rss(void)
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static void report(const char * bench, const char * file, struct bench_result * r)
+{
+    const char * name = strrchr(file, '/');
+
+    printf("%-14s %-32s %9.1f MB/s %9.2f pages/s %8ld KB peak",
+           bench, name ? name + 1 : file,
+           r->raster_bytes/1e6/r->seconds, r->pages/r->seconds, r->peak_rss);
+    if(r->output_bytes)
+        printf("  ratio %.1f", (double)r->raster_bytes/r->output_bytes);
+    printf("\n");
+    fflush(stdout);
+}
+
+static unsigned open_urf(struct urf_input * in, const char * file)
+{
+    struct urf_file_header head;
+    int fd = open(file, O_RDONLY);
+
+    if(fd < 0 || input_open(in, fd) != 0) die("Unable to open unirast file");
+    if(input_read(in, &head, sizeof(head)) < sizeof(head)) die("Unable to read file header");
+    if(strncmp(head.unirast, "UNIRAST", 7) != 0) die("Bad File Header");
+
+    return ntohl(head.page_count);
+}
+
+static void close_urf(struct urf_input * in)
+{
+    int fd = in->fd;
+
+    input_close(in);
+    close(fd);
+}
+
+static inline uint64_t raster_bytes(struct pdf_page * page)
+{
+    return (uint64_t)page->urf_width*page->urf_height*(page->bpp/8);
+}
+
+// Stands for compress_stage() when only decoding
+static void drop_stage(struct pipeline * pl)
+{
+    struct raster_band * band;
+
+    while((band = pl->bands.pop())->page != NULL)
+    {
+        if(band->last)
+            delete band->page;
+        band_release(pl, band);
+    }
+    band_release(pl, band);
+}
+
+// Keep the bands of one page for the compression benchmark
+static void keep_stage(struct pipeline * pl, std::vector<struct raster_band *> * bands)
+{
+    struct raster_band * band;
+
+    do {
+        band = pl->bands.pop();
+        bands->push_back(band);
+    } while(!band->last);
+}
+
+// Header parsing, pre-scan and decoding, bands are dropped as they come
+static void bench_decode(const char * file, struct urf_options * options, struct bench_result * r)
+{
+    struct urf_input in;
+    struct pipeline pl(NULL, options);
+    unsigned count = open_urf(&in, file), page;
+    double start = now();
+    std::thread drop_thread(drop_stage, &pl);
+
+    for(page = 0 ; page < count ; ++page)
+    {
+        struct pdf_page * pdf_page = read_page(&in, options, page, NULL);
+
+        r->raster_bytes += raster_bytes(pdf_page);
+        decode_page(&in, pdf_page, &pl);
+    }
+    pl.bands.push(band_new(&pl, NULL, 0));
+    drop_thread.join();
+
+    r->seconds = now() - start;
+    r->pages = count;
+    r->peak_rss = self_peak_rss();
+    close_urf(&in);
+}
+
+// Page image compression alone, each page is decoded beforehand
+static void bench_compress(const char * file, struct urf_options * options, struct bench_result * r)
+{
+    struct urf_input in;
+    unsigned count = open_urf(&in, file), page;
+
+    for(page = 0 ; page < count ; ++page)
+    {
+        struct pdf_page * pdf_page = read_page(&in, options, page, NULL);
+        std::vector<struct raster_band *> bands;
+        unsigned i;
+
+        {
+            struct pipeline pl(NULL, options);
+            std::thread keep_thread(keep_stage, &pl, &bands);
+
+            decode_page(&in, pdf_page, &pl);
+            keep_thread.join();
+        }
+
+        double start = now();
+        struct pipeline pl(NULL, options);
+        std::thread compress_thread(compress_stage, &pl);
+
+        for(i = 0 ; i < bands.size() ; ++i)
+            pl.bands.push(bands[i]);
+        pl.bands.push(band_new(&pl, NULL, 0));
+
+        pdf_page = pl.pages.pop();
+        for(std::deque<struct pdf_strip>::iterator strip = pdf_page->strips.begin() ; strip != pdf_page->strips.end() ; ++strip)
+        {
+            if(strip->done.valid())
+                strip->done.get();
+            r->output_bytes += strip->image_data.size();
+        }
+        pl.pages.pop();
+        compress_thread.join();
+        r->seconds += now() - start;
+
+        r->raster_bytes += raster_bytes(pdf_page);
+        delete pdf_page;
+    }
+
+    r->pages = count;
+    r->peak_rss = self_peak_rss();
+    close_urf(&in);
+}
+
+// A whole conversion by a urftopdf binary, as run by CUPS
+static void bench_convert(const char * binary, const char * file, const char * options, struct bench_result * r)
+{
+    struct rusage usage;
+    int status;
+    double start = now();
+    pid_t pid = fork();
+
+    if(pid < 0) die("Unable to fork");
+    if(pid == 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execl(binary, binary, "1", "bench", "bench", "1", options, file, (char *)NULL);
+        _exit(127);
+    }
+
+    if(wait4(pid, &status, 0, &usage) != pid) die("Unable to wait for urftopdf");
+    r->seconds = now() - start;
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        fprintf(stderr, "ERROR: (urfbench) %s failed on %s\n", binary, file);
+        exit(1);
+    }
+    r->peak_rss = usage.ru_maxrss;
+}
+
+int main(int argc, char **argv)
+{
+    struct urf_options options;
+    std::vector<const char *> binaries;
+    const char * option_string = "";
+    unsigned runs = 3, run;
+    int opt, i;
+
+    while((opt = getopt(argc, argv, "o:r:b:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'o': option_string = optarg; break;
+            case 'r': runs = atoi(optarg); break;
+            case 'b': binaries.push_back(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-o options] [-r runs] [-b urftopdf]... file.urf...\n", argv[0]);
+                return 1;
+        }
+    }
+    if(runs == 0)
+        runs = 1;
+
+    parse_options(&options, option_string);
+
+    // Best of the runs
+    for(i = optind ; i < argc ; ++i)
+    {
+        struct bench_result best, r;
+        unsigned b;
+
+        memset(&best, 0, sizeof(best));
+        for(run = 0 ; run < runs ; ++run)
+        {
+            memset(&r, 0, sizeof(r));
+            bench_decode(argv[i], &options, &r);
+            if(run == 0 || r.seconds < best.seconds)
+                best = r;
+        }
+        report("decode", argv[i], &best);
+        unsigned pages = best.pages;
+        uint64_t bytes = best.raster_bytes;
+
+        for(run = 0 ; run < runs ; ++run)
+        {
+            memset(&r, 0, sizeof(r));
+            bench_compress(argv[i], &options, &r);
+            if(run == 0 || r.seconds < best.seconds)
+                best = r;
+        }
+        report("compress", argv[i], &best);
+
+        for(b = 0 ; b < binaries.size() ; ++b)
+        {
+            const char * name = strrchr(binaries[b], '/');
+
+            for(run = 0 ; run < runs ; ++run)
+            {
+                memset(&r, 0, sizeof(r));
+                bench_convert(binaries[b], argv[i], option_string, &r);
+                r.pages = pages;
+                r.raster_bytes = bytes;
+                if(run == 0 || r.seconds < best.seconds)
+                    best = r;
+            }
+            report(name ? name + 1 : binaries[b], argv[i], &best);
+        }
+    }
+
+    return 0;
+}
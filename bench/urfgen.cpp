@@ -0,0 +1,351 @@
+/**
+ * This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @brief Generate synthetic URF files for the benchmarks
+ * @file urfgen.cpp
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <arpa/inet.h>   // htonl
+
+#include <vector>
+#include <algorithm>
+
+#include "../unirast.h"
+
+#define LETTER_WIDTH 85   // 1/10 inch
+#define LETTER_HEIGHT 110
+
+enum page_kind
+{
+    KIND_TEXT,      // black glyphs on white, long runs and repeated lines
+    KIND_PHOTO,     // smooth color gradients with noise, mostly literals
+    KIND_BLANK,     // white page
+    KIND_GRAYRGB,   // photo without any color, stored as RGB
+};
+
+struct urf_generator
+{
+    FILE * out;
+    unsigned kind;
+    unsigned bpp;
+    unsigned colorspace;
+    unsigned components;
+    unsigned sample_bytes;
+    unsigned pixel_size;
+    unsigned width;
+    unsigned height;
+    unsigned dpi;
+    uint32_t seed;
+    std::vector<uint8_t> glyphs;   // one bit per glyph cell, GLYPH_COLS x GLYPH_ROWS
+};
+
+#define GLYPH_COLS 5
+#define GLYPH_ROWS 7
+#define GLYPHS 64
+
+void die(const char * str)
+{
+    fprintf(stderr, "ERROR: (urfgen) %s\n", str);
+    exit(1);
+}
+
+static inline uint32_t next_random(struct urf_generator * gen)
+{
+    // xorshift32
+    gen->seed ^= gen->seed << 13;
+    gen->seed ^= gen->seed >> 17;
+    gen->seed ^= gen->seed << 5;
+    return gen->seed;
+}
+
+// Store an RGB value, as CMY inks for CMYK pixels
+static void put_pixel(struct urf_generator * gen, uint8_t * dst, const uint8_t * value)
+{
+    unsigned c, b;
+
+    memset(dst, (gen->components == 4) ? 0 : 0xFF, gen->pixel_size);
+    for(c = 0 ; c < gen->components ; ++c)
+    {
+        uint8_t v = value[c];
+
+        if(gen->components == 4)
+            v = (c < 3) ? 255 - value[c] : 0;
+        for(b = 0 ; b < gen->sample_bytes ; ++b)
+            dst[c*gen->sample_bytes + b] = v;
+    }
+}
+
+static void text_line(struct urf_generator * gen, uint8_t * line, unsigned y)
+{
+    uint8_t white[4] = { 255, 255, 255, 255 };
+    uint8_t black[4] = { 0, 0, 0, 0 };
+    unsigned margin = gen->dpi;
+    unsigned cell = gen->dpi/40 ? gen->dpi/40 : 1;   // glyph dot size
+    unsigned advance = (GLYPH_COLS + 1)*cell;
+    unsigned line_height = (GLYPH_ROWS + 5)*cell;
+    unsigned x;
+
+    for(x = 0 ; x < gen->width ; ++x)
+        put_pixel(gen, &line[x*gen->pixel_size], white);
+
+    if(y < margin || y >= gen->height - margin)
+        return;
+
+    unsigned text_line = (y - margin)/line_height;
+    unsigned row = ((y - margin) % line_height)/cell;
+    if(row >= GLYPH_ROWS)
+        return;
+
+    // Short last lines of paragraphs
+    unsigned end = gen->width - margin;
+    if(text_line % 7 == 6)
+        end = margin + (end - margin)/3;
+
+    for(x = margin ; x + advance <= end ; x += advance)
+    {
+        unsigned glyph = (x/advance*31 + text_line*17) % GLYPHS;
+        unsigned col;
+
+        // Word spacing
+        if(glyph % 6 == 0)
+            continue;
+
+        for(col = 0 ; col < GLYPH_COLS ; ++col)
+        {
+            if(!gen->glyphs[(glyph*GLYPH_ROWS + row)*GLYPH_COLS + col])
+                continue;
+            for(unsigned i = 0 ; i < cell ; ++i)
+                put_pixel(gen, &line[(x + col*cell + i)*gen->pixel_size], black);
+        }
+    }
+}
+
+static void photo_line(struct urf_generator * gen, uint8_t * line, unsigned y)
+{
+    double fy = (double)y/gen->height;
+    unsigned x, c;
+
+    for(x = 0 ; x < gen->width ; ++x)
+    {
+        double fx = (double)x/gen->width;
+        uint8_t value[4];
+        int noise = (int)(next_random(gen) % 9) - 4;
+
+        value[0] = 128 + 100*sin(6.0*fx + 2.0*fy);
+        value[1] = 128 + 100*sin(3.0*fx*fy + 1.0);
+        value[2] = 128 + 100*cos(4.0*fy - fx);
+        value[3] = 255;
+        for(c = 0 ; c < 3 ; ++c)
+        {
+            int v = value[c] + noise;
+            value[c] = v < 0 ? 0 : (v > 255 ? 255 : v);
+        }
+        // Neutral, the same sample in the three channels
+        if(gen->kind == KIND_GRAYRGB)
+            value[1] = value[2] = value[0];
+        put_pixel(gen, &line[x*gen->pixel_size], value);
+    }
+}
+
+static bool is_white(struct urf_generator * gen, const uint8_t * pixel)
+{
+    unsigned i;
+
+    for(i = 0 ; i < gen->pixel_size ; ++i)
+    {
+        if(pixel[i] != ((gen->components == 4) ? 0 : 0xFF))
+            return false;
+    }
+
+    return true;
+}
+
+// PackBits as used by URF, counting pixels instead of bytes
+static void write_line(struct urf_generator * gen, const uint8_t * line, unsigned line_repeat, std::vector<uint8_t> & out)
+{
+    unsigned ps = gen->pixel_size;
+    unsigned x = 0, white_from = gen->width;
+
+    while(white_from > 0 && is_white(gen, &line[(white_from - 1)*ps]))
+        --white_from;
+
+    out.push_back(line_repeat - 1);
+
+    while(x < white_from)
+    {
+        unsigned n = 1;
+
+        while(x + n < gen->width && n < 128 && memcmp(&line[x*ps], &line[(x + n)*ps], ps) == 0)
+            ++n;
+
+        if(n > 1 || x + 1 == gen->width)
+        {
+            out.push_back(n - 1);
+            out.insert(out.end(), &line[x*ps], &line[(x + 1)*ps]);
+            x += n;
+            continue;
+        }
+
+        // Literal up to the next repeat
+        while(x + n < white_from && n < 128 &&
+              (x + n + 1 >= gen->width || memcmp(&line[(x + n)*ps], &line[(x + n + 1)*ps], ps) != 0))
+            ++n;
+        if(n == 1)
+            out.push_back(0);
+        else
+            out.push_back(257 - n);
+        out.insert(out.end(), &line[x*ps], &line[(x + n)*ps]);
+        x += n;
+    }
+
+    if(x < gen->width)
+        out.push_back(0x80);
+}
+
+static void write_page(struct urf_generator * gen)
+{
+    uint8_t header[32];
+    uint32_t value;
+    std::vector<uint8_t> line(gen->width*gen->pixel_size), prev, out;
+    unsigned y, line_repeat = 0;
+
+    memset(header, 0, sizeof(header));
+    header[0] = gen->bpp;
+    header[1] = gen->colorspace;
+    header[3] = UNIRAST_QUALITY_4;
+    value = htonl(gen->width);
+    memcpy(&header[12], &value, 4);
+    value = htonl(gen->height);
+    memcpy(&header[16], &value, 4);
+    value = htonl(gen->dpi);
+    memcpy(&header[20], &value, 4);
+    if(fwrite(header, 1, sizeof(header), gen->out) != sizeof(header)) die("Unable to write page");
+
+    for(y = 0 ; y < gen->height ; ++y)
+    {
+        if(gen->kind == KIND_TEXT)
+            text_line(gen, &line[0], y);
+        else if(gen->kind == KIND_BLANK)
+            std::fill(line.begin(), line.end(), (gen->components == 4) ? 0 : 0xFF);
+        else
+            photo_line(gen, &line[0], y);
+
+        if(line_repeat && (line != prev || line_repeat == 256))
+        {
+            write_line(gen, &prev[0], line_repeat, out);
+            line_repeat = 0;
+        }
+        if(line_repeat == 0)
+            prev = line;
+        ++line_repeat;
+
+        if(out.size() >= 1024*1024)
+        {
+            if(fwrite(&out[0], 1, out.size(), gen->out) != out.size()) die("Unable to write page");
+            out.clear();
+        }
+    }
+    write_line(gen, &prev[0], line_repeat, out);
+    if(fwrite(&out[0], 1, out.size(), gen->out) != out.size()) die("Unable to write page");
+}
+
+int main(int argc, char **argv)
+{
+    struct urf_generator gen;
+    unsigned pages = 1, page, i;
+    uint8_t header[12];
+    uint32_t count;
+
+    if(argc < 5)
+    {
+        fprintf(stderr, "Usage: %s <file> <text|photo|blank|grayrgb> <bpp> <dpi> [pages] [seed]\n", argv[0]);
+        return 1;
+    }
+
+    if(strcmp(argv[2], "text") == 0)
+        gen.kind = KIND_TEXT;
+    else if(strcmp(argv[2], "photo") == 0)
+        gen.kind = KIND_PHOTO;
+    else if(strcmp(argv[2], "blank") == 0)
+        gen.kind = KIND_BLANK;
+    else if(strcmp(argv[2], "grayrgb") == 0)
+        gen.kind = KIND_GRAYRGB;
+    else
+        die("Unknown page kind");
+
+    gen.bpp = atoi(argv[3]);
+    gen.dpi = atoi(argv[4]);
+    if(argc > 5)
+        pages = atoi(argv[5]);
+    gen.seed = (argc > 6) ? atoi(argv[6]) : 2463534242u;
+    if(gen.seed == 0)
+        gen.seed = 1;
+
+    // 8 bpp is gray, 32 bpp CMYK, 24 and 64 bpp are RGB with 8 and 16-bit samples
+    switch(gen.bpp)
+    {
+        case UNIRAST_BPP_8BIT:
+            gen.colorspace = UNIRAST_COLOR_SPACE_GRAYSCALE_8BIT;
+            gen.components = 1;
+            gen.sample_bytes = 1;
+            break;
+        case UNIRAST_BPP_24BIT:
+            gen.colorspace = UNIRAST_COLOR_SPACE_SRGB_24BIT_1;
+            gen.components = 3;
+            gen.sample_bytes = 1;
+            break;
+        case UNIRAST_BPP_32BIT:
+            gen.colorspace = UNIRAST_COLOR_SPACE_CMYK_32BIT_64BIT;
+            gen.components = 4;
+            gen.sample_bytes = 1;
+            break;
+        case UNIRAST_BPP_64BIT:
+            gen.colorspace = UNIRAST_COLOR_SPACE_SRGB_24BIT_1;
+            gen.components = 3;
+            gen.sample_bytes = 2;
+            break;
+        default:
+            die("Invalid Bit Per Pixel value");
+    }
+    if(gen.dpi == 0) die("Invalid resolution");
+
+    gen.pixel_size = gen.bpp/8;
+    gen.width = gen.dpi*LETTER_WIDTH/10;
+    gen.height = gen.dpi*LETTER_HEIGHT/10;
+
+    gen.glyphs.resize(GLYPHS*GLYPH_ROWS*GLYPH_COLS);
+    for(i = 0 ; i < gen.glyphs.size() ; ++i)
+        gen.glyphs[i] = (next_random(&gen) % 5) < 2;
+
+    gen.out = fopen(argv[1], "wb");
+    if(gen.out == NULL) die("Unable to open output file");
+
+    memcpy(header, "UNIRAST", 8);
+    count = htonl(pages);
+    memcpy(&header[8], &count, 4);
+    if(fwrite(header, 1, sizeof(header), gen.out) != sizeof(header)) die("Unable to write file header");
+
+    for(page = 0 ; page < pages ; ++page)
+        write_page(&gen);
+
+    if(fclose(gen.out) != 0) die("Unable to write output file");
+
+    return 0;
+}
@@ -2,6 +2,14 @@
 
 [ ! -d $DESTDIR/usr/share/cups/mime ] && mkdir -p $DESTDIR/usr/share/cups/mime
 cp urftopdf.types  $DESTDIR/usr/share/cups/mime
-cp urftopdf.convs  $DESTDIR/usr/share/cups/mime
 [ ! -d $DESTDIR/usr/lib/cups/filter ] && mkdir -p $DESTDIR/usr/lib/cups/filter
 cp urftopdf $DESTDIR/usr/lib/cups/filter
+ln -sf urftopdf $DESTDIR/usr/lib/cups/filter/urftopwg
+# The hpdf backend cannot write PCLm
+if [ "$PDF_BACKEND" = "hpdf" ]; then
+	grep -v urftopclm urftopdf.convs > $DESTDIR/usr/share/cups/mime/urftopdf.convs
+	rm -f $DESTDIR/usr/lib/cups/filter/urftopclm
+else
+	cp urftopdf.convs  $DESTDIR/usr/share/cups/mime
+	ln -sf urftopdf $DESTDIR/usr/lib/cups/filter/urftopclm
+fi
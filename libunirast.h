@@ -0,0 +1,116 @@
+/**
+ * This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @brief libunirast, the urftopdf converter as a library
+ * @file libunirast.h
+ */
+
+#ifndef _LIBUNIRAST_H_
+#define _LIBUNIRAST_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define UNIRAST_API __attribute__((visibility("default")))
+
+enum unirast_output
+{
+    UNIRAST_OUTPUT_PDF,
+    UNIRAST_OUTPUT_PWG,         // PWG Raster, as urftopwg
+    UNIRAST_OUTPUT_PCLM,        // PCLm, as urftopclm
+};
+
+enum unirast_log_level
+{
+    UNIRAST_LOG_DEBUG,
+    UNIRAST_LOG_INFO,
+    UNIRAST_LOG_CRIT,           // the error failing the job
+    UNIRAST_LOG_STATS,          // the urf-stats JSON object
+};
+
+/*
+ * A page as decoded: rows are those of its image, after the urf-gray,
+ * urf-bilevel, urf-16bit and urf-max-dpi options.  Samples are in the URF
+ * order, 16-bit ones big endian, CMYK white is 0, 1-bit rows are packed
+ * from the high bit with 1 for white.
+ */
+struct unirast_page
+{
+    unsigned number;            // from 0
+    unsigned width;             // of the rows, in pixels
+    unsigned height;            // rows
+    unsigned components;        // 1 gray, 3 RGB, 4 CMYK
+    unsigned bits;              // per component, 1, 8 or 16
+    unsigned line_bytes;        // of a row
+    unsigned urf_width;         // URF raster size, downsampled pages have fewer rows
+    unsigned urf_height;
+    unsigned dpi;               // of the URF raster
+    unsigned colorspace;        // enum unirast_color_space_e
+    unsigned duplex;            // enum unirast_duplex_mode_e
+    unsigned quality;           // enum unirast_quality_e
+};
+
+/*
+ * Callbacks run on the threads of the job, one at a time and in page order.
+ * They return 0 to go on, anything else fails the job.  log may be called
+ * from any thread of the job, one line at a time.
+ */
+struct unirast_params
+{
+    const char * options;       // CUPS job options, urf-threads=4 ..., may be NULL
+    unsigned copies;            // of the document, 0 for 1
+    int output;                 // enum unirast_output
+    unsigned long job_id;       // for urf-stats
+    void * ctx;                 // given to the callbacks
+
+    // Before the rows of each page
+    int (*page)(void * ctx, const struct unirast_page * page);
+    // count identical rows from row y, not with UNIRAST_OUTPUT_PWG
+    int (*rows)(void * ctx, const struct unirast_page * page, unsigned y, const unsigned char * row, unsigned count);
+    // The document, in order; none is made when NULL
+    int (*write)(void * ctx, const void * data, size_t size);
+    // Diagnostics, one line without its newline at a time; none when NULL
+    void (*log)(void * ctx, int level, const char * message);
+};
+
+struct unirast_job;
+
+// NULL on invalid parameters
+UNIRAST_API struct unirast_job * unirast_job_new(const struct unirast_params * params);
+
+/*
+ * Streaming input: the URF bytes in as many calls as needed, then
+ * unirast_job_finish() once they are all given.  unirast_job_write()
+ * returns once the job has taken data, -1 if the job failed.
+ */
+UNIRAST_API int unirast_job_write(struct unirast_job * job, const void * data, size_t size);
+// Waits for the last page, 0 if the job succeeded
+UNIRAST_API int unirast_job_finish(struct unirast_job * job);
+
+// Whole input from a file descriptor instead, mapped when it is a regular file
+UNIRAST_API int unirast_job_convert_fd(struct unirast_job * job, int fd);
+
+// Why the job failed, NULL if it did not
+UNIRAST_API const char * unirast_job_error(struct unirast_job * job);
+
+UNIRAST_API void unirast_job_free(struct unirast_job * job);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -20,311 +20,632 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <time.h>
 
 #include <arpa/inet.h>   // ntohl
 
 #include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <future>
+#include <functional>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <stdexcept>
+
+#ifdef LIBDEFLATE_ENGINE
+#include <libdeflate.h>
+#elif defined(ZLIBNG_ENGINE)
+#include <zlib-ng.h>
+#else
+#include <zlib.h>
+#endif
+#include <jpeglib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #ifdef QPDF_BACKEND
 #include <qpdf/QPDF.hh>
 #include <qpdf/QPDFWriter.hh>
 #include <qpdf/QUtil.hh>
 
-#include <qpdf/Pl_Flate.hh>
-#include <qpdf/Pl_Buffer.hh>
 #endif
 #ifdef HPDF_BACKEND
-#include <cups/cups.h>
 #include <hpdf.h>
 #endif
 
 #include "unirast.h"
+#include "libunirast.h"
 
 #define DEFAULT_PDF_UNIT 72   // 1/72 inch
 
 #define PROGRAM "urftopdf"
 
+// To the log of the job, stderr outside of a job
+void job_log_line(int level, const char * message);
+void job_log(int level, const char * format, ...) __attribute__((format(printf, 2, 3)));
+
 #ifdef URF_DEBUG
-#define dprintf(format, ...) fprintf(stderr, "DEBUG: (" PROGRAM ") " format, __VA_ARGS__)
+#define dprintf(format, ...) job_log(UNIRAST_LOG_DEBUG, format, __VA_ARGS__)
 #else
 #define dprintf(format, ...)
 #endif
 
-#define iprintf(format, ...) fprintf(stderr, "INFO: (" PROGRAM ") " format, __VA_ARGS__)
+#define iprintf(format, ...) job_log(UNIRAST_LOG_INFO, format, __VA_ARGS__)
+
+/*
+ * Errors end the job, not the process: die() throws, the stages catch it
+ * and drain the pipeline, see pipeline_fail().
+ */
+struct urf_error : std::runtime_error
+{
+    urf_error(const char * str) : std::runtime_error(str) {}
+};
 
 void die(const char * str)
 {
-    fprintf(stderr, "CRIT: (" PROGRAM ") die(%s) [%m]\n", str);
-    exit(1);
+    job_log(UNIRAST_LOG_CRIT, "die(%s) [%s]\n", str, strerror(errno));
+    throw urf_error(str);
 }
 
-//------------- PDF ---------------
+//------------- Memory ---------------
 
-struct pdf_info
+/*
+ * Memory budget (urf-max-memory, or RIP_MAX_CACHE as set by CUPS): the
+ * input buffer, bands and compressed images stay in RAM up to the budget,
+ * beyond it they go to an unlinked temporary file mapped in memory, which
+ * the kernel can write out instead of swapping or killing the job.
+ */
+struct memory_budget
 {
-#ifdef HPDF_BACKEND
-    HPDF_Doc pdf;
-    HPDF_Page page;
-    HPDF_Image image;
-    HPDF_ColorSpace color_space;
-    unsigned stride_bytes;
-    uint8_t * page_data;
-    char * filename;
-#endif
-#ifdef QPDF_BACKEND
-    pdf_info() 
-      : pagecount(0),
-        width(0),height(0),
-        pixel_bytes(0),line_bytes(0),
-        bpp(0),
-        page_width(0),page_height(0)
+    memory_budget()
+      : limit(0),
+        used(0),
+        spilled(0),
+        fd(-1),
+        file_size(0)
     {
     }
 
-    QPDF pdf;
-    QPDFObjectHandle page;
-    PointerHolder<Buffer> page_data;
-    double page_width,page_height;
-    unsigned page_colourspace;
-#endif
-    unsigned pagecount;
-    unsigned width;
-    unsigned height;
-    unsigned pixel_bytes;
-    unsigned line_bytes;
-    unsigned bpp;
+    ~memory_budget()
+    {
+        std::map<void *, std::pair<off_t, size_t> >::iterator block;
+
+        for(block = mapped.begin() ; block != mapped.end() ; ++block)
+            munmap(block->first, block->second.second);
+        if(fd >= 0)
+            close(fd);
+    }
+
+    uint64_t limit;                     // bytes, 0 for no limit
+    std::atomic<uint64_t> used;         // in RAM, only counted with a limit
+    std::atomic<uint64_t> spilled;      // bytes ever mapped from the file
+    std::mutex lock;                    // for the spill file
+    int fd;                             // -1 until the first spill
+    uint64_t file_size;
+    std::map<void *, std::pair<off_t, size_t> > mapped;  // spilled blocks, offset and size
 };
 
-#ifdef HPDF_BACKEND
-void pdf_error_handler(HPDF_STATUS error_no, HPDF_STATUS detail_no, void *user_data)
+// The job's, see job_enter(), threads outside of a job share the default one
+static struct memory_budget default_budget;
+static thread_local struct memory_budget * budget = &default_budget;
+
+// Sizes as in RIP_MAX_CACHE: bytes, or a number followed by k, m, g or t (256x256 tiles of 4 bytes)
+uint64_t parse_size(const char * str)
 {
-    fprintf(stderr, "CRIT: (" PROGRAM ") pdf_error_handler error_no=%04X, detail_no=%u\n", (HPDF_UINT)error_no, (HPDF_UINT)detail_no);
-    exit(1);
+    char * end;
+    uint64_t size = strtoull(str, &end, 10);
+
+    switch(tolower(*end))
+    {
+        case 'k': return size << 10;
+        case 'm': return size << 20;
+        case 'g': return size << 30;
+        case 't': return size*256*256*4;
+    }
+
+    return size;
 }
 
-int create_pdf_file(struct pdf_info * info, char * filename, unsigned pagecount)
+static void * spill_alloc(size_t size)
 {
-    if((info->pdf = HPDF_New (pdf_error_handler, NULL)) == NULL) die("cannot create PdfDoc object");
+    std::lock_guard<std::mutex> guard(budget->lock);
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    void * block;
 
-    info->filename = filename;
+    size = (size + page_size - 1)/page_size*page_size;
 
-    HPDF_SetCompressionMode(info->pdf, HPDF_COMP_ALL);
+    if(budget->fd < 0)
+    {
+        const char * dir = getenv("TMPDIR");
+        std::string path = std::string(dir ? dir : "/tmp") + "/urftopdf-XXXXXX";
 
-    info->pagecount = pagecount;
+        budget->fd = mkstemp(&path[0]);
+        if(budget->fd < 0)
+            return NULL;
+        unlink(path.c_str());
+        iprintf("Memory budget of %llu bytes exceeded, spilling to %s\n", (unsigned long long)budget->limit, path.c_str());
+    }
 
-    return 0;
+    if(ftruncate(budget->fd, budget->file_size + size) != 0)
+        return NULL;
+    block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, budget->fd, budget->file_size);
+    if(block == MAP_FAILED)
+        return NULL;
+
+    try {
+        budget->mapped[block] = std::make_pair((off_t)budget->file_size, size);
+    } catch (...) {
+        munmap(block, size);
+        return NULL;
+    }
+    budget->file_size += size;
+    budget->spilled += size;
+
+    return block;
+}
+
+// NULL on failure, align is a power of two
+void * memory_alloc(size_t size, size_t align)
+{
+    void * block = NULL;
+
+    if(budget->limit && (budget->used += size) > budget->limit)
+    {
+        budget->used -= size;
+        return spill_alloc(size);
+    }
+
+    if(posix_memalign(&block, align, size) != 0)
+    {
+        if(budget->limit)
+            budget->used -= size;
+        return NULL;
+    }
+
+    return block;
+}
+
+void memory_free(void * block, size_t size)
+{
+    if(block == NULL)
+        return;
+
+    if(budget->limit)
+    {
+        std::lock_guard<std::mutex> guard(budget->lock);
+        std::map<void *, std::pair<off_t, size_t> >::iterator mapped = budget->mapped.find(block);
+
+        if(mapped != budget->mapped.end())
+        {
+            munmap(block, mapped->second.second);
+#ifdef FALLOC_FL_PUNCH_HOLE
+            // The file only grows, give the blocks back to the file system
+            fallocate(budget->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, mapped->second.first, mapped->second.second);
+#endif
+            budget->mapped.erase(mapped);
+            return;
+        }
+        budget->used -= size;
+    }
+
+    free(block);
 }
 
-void draw_pdf_page(struct pdf_info * info)
+// Lets std::vector take its storage from the budget
+template<class T>
+struct budget_allocator
 {
-    if(info->page_data)
+    typedef T value_type;
+
+    budget_allocator() {}
+    template<class U> budget_allocator(const budget_allocator<U> &) {}
+
+    T * allocate(size_t n)
     {
-        //Finish previous Page
-        info->image = HPDF_LoadRawImageFromMem(info->pdf, info->page_data, info->width, info->height, info->color_space, 8);
-        if(info->image == NULL) die("Unable to load image data");
+        T * block = (T *)memory_alloc(n*sizeof(T), 64);
+        if(block == NULL)
+            throw std::bad_alloc();
+        return block;
+    }
+    void deallocate(T * block, size_t n) { memory_free(block, n*sizeof(T)); }
+};
 
-        HPDF_Page_DrawImage(info->page, info->image, 0, 0, HPDF_Page_GetWidth(info->page), HPDF_Page_GetHeight(info->page));
+template<class T, class U>
+bool operator==(const budget_allocator<T> &, const budget_allocator<U> &) { return true; }
+template<class T, class U>
+bool operator!=(const budget_allocator<T> &, const budget_allocator<U> &) { return false; }
 
-        free(info->page_data);
-        info->page_data = NULL;
+typedef std::vector<uint8_t, budget_allocator<uint8_t> > image_buffer;
+
+//------------- Input ---------------
+
+#define INPUT_BUFFER_SIZE (1024*1024)
+
+/*
+ * Bytes handed by unirast_job_write(): the writer waits until the decoder
+ * has copied them into its input buffer, as read() would.
+ */
+struct urf_feed
+{
+    urf_feed()
+      : data(NULL),
+        size(0),
+        end(false),
+        closed(false)
+    {
     }
+
+    std::mutex lock;
+    std::condition_variable cond;
+    const uint8_t * data;
+    size_t size;
+    bool end;           // no more data to come
+    bool closed;        // the decoder reads no more
+};
+
+// Returns 0 at the end of the data
+size_t feed_read(struct urf_feed * feed, uint8_t * dst, size_t size)
+{
+    std::unique_lock<std::mutex> guard(feed->lock);
+
+    feed->cond.wait(guard, [feed] { return feed->size > 0 || feed->end; });
+    if(feed->size == 0)
+        return 0;
+    if(size > feed->size)
+        size = feed->size;
+    memcpy(dst, feed->data, size);
+    feed->data += size;
+    feed->size -= size;
+    if(feed->size == 0)
+        feed->cond.notify_all();
+
+    return size;
 }
 
-int add_pdf_page(struct pdf_info * info, int pagen, unsigned width, unsigned height, int bpp, unsigned dpi,
-                 unsigned color_space)
+// Returns false when the decoder stopped before taking all of data
+bool feed_write(struct urf_feed * feed, const uint8_t * data, size_t size)
 {
-    draw_pdf_page(info);
+    std::unique_lock<std::mutex> guard(feed->lock);
 
-    info->width = width;
-    info->height = height;
-    info->pixel_bytes = bpp/8;
-    info->line_bytes = (width*info->pixel_bytes);
-    info->bpp = bpp;
+    feed->data = data;
+    feed->size = size;
+    feed->cond.notify_all();
+    feed->cond.wait(guard, [feed] { return feed->size == 0 || feed->closed; });
+    size = feed->size;
+    feed->data = NULL;
+    feed->size = 0;
 
-    info->page_data = (uint8_t*)malloc(info->line_bytes*info->height);
-    if(info->page_data == NULL) die("Unable to allocate page data");
+    return size == 0;
+}
 
-    info->page = HPDF_AddPage(info->pdf);
+void feed_end(struct urf_feed * feed)
+{
+    std::lock_guard<std::mutex> guard(feed->lock);
 
-    info->color_space = HPDF_CS_DEVICE_RGB;
-    if(color_space == UNIRAST_COLOR_SPACE_GRAYSCALE_8BIT)
-        info->color_space = HPDF_CS_DEVICE_GRAY;
+    feed->end = true;
+    feed->cond.notify_all();
+}
 
-    // Convert to 72DPI sizes
-    HPDF_Page_SetWidth(info->page, ((float)info->width/(float)dpi)*DEFAULT_PDF_UNIT);
-    HPDF_Page_SetHeight(info->page, ((float)info->height/(float)dpi)*DEFAULT_PDF_UNIT);
+void feed_close(struct urf_feed * feed)
+{
+    std::lock_guard<std::mutex> guard(feed->lock);
+
+    feed->closed = true;
+    feed->cond.notify_all();
+}
+
+/*
+ * Input is either mmap'ed (regular files) or read in large chunks into a
+ * refillable buffer (pipes and feeds), the decoder only moves the cur
+ * pointer.
+ */
+struct urf_input
+{
+    int fd;
+    struct urf_feed * feed;     // read instead of fd when set
+    const uint8_t * cur;
+    const uint8_t * end;
+    uint8_t * map;
+    size_t map_size;
+    size_t map_released;   // mapped bytes dropped by input_release()
+    uint8_t * buffer;
+    size_t buffer_size;
+    off_t buffer_offset;   // file offset of buffer[0]
+    const uint8_t * mark;  // input_refill() keeps the data from here on
+};
+
+int input_open(struct urf_input * in, int fd)
+{
+    struct stat st;
+
+    memset(in, 0, sizeof(*in));
+    in->fd = fd;
+
+    if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        off_t offset = lseek(fd, 0, SEEK_CUR);
+        void * map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if(map != MAP_FAILED && offset >= 0 && offset <= st.st_size)
+        {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            in->map = (uint8_t*)map;
+            in->map_size = st.st_size;
+            in->cur = in->map + offset;
+            in->end = in->map + in->map_size;
+            return 0;
+        }
+        if(map != MAP_FAILED)
+            munmap(map, st.st_size);
+    }
+
+    // Not mappable, fall back to buffered reads
+    in->buffer_size = INPUT_BUFFER_SIZE;
+    in->buffer = (uint8_t*)memory_alloc(in->buffer_size, 64);
+    if(in->buffer == NULL) return 1;
+    in->cur = in->end = in->buffer;
 
     return 0;
 }
 
-int close_pdf_file(struct pdf_info * info)
+int input_open_feed(struct urf_input * in, struct urf_feed * feed)
 {
-    draw_pdf_page(info);
+    memset(in, 0, sizeof(*in));
+    in->fd = -1;
+    in->feed = feed;
 
-    HPDF_SaveToFile(info->pdf, info->filename);
+    in->buffer_size = INPUT_BUFFER_SIZE;
+    in->buffer = (uint8_t*)memory_alloc(in->buffer_size, 64);
+    if(in->buffer == NULL) return 1;
+    in->cur = in->end = in->buffer;
 
     return 0;
 }
 
-void pdf_set_line(struct pdf_info * info, unsigned line_n, uint8_t line[])
+void input_close(struct urf_input * in)
+{
+    if(in->map)
+        munmap(in->map, in->map_size);
+    memory_free(in->buffer, in->buffer_size);
+    memset(in, 0, sizeof(*in));
+}
+
+// Slow path of input_ensure(), returns false on EOF or read error
+bool input_refill(struct urf_input * in, size_t n)
 {
-    dprintf("pdf_set_line(%d)\n", line_n);
+    const uint8_t * keep = in->mark ? in->mark : in->cur;
+    size_t avail = in->end - keep;
+    size_t cur = in->cur - keep;
+
+    if(in->map)
+        return false;
 
-    if(line_n > info->height)
+    in->buffer_offset += keep - in->buffer;
+
+    // Keep the unread tail, grow the buffer if a single request is bigger
+    if(cur + n > in->buffer_size)
     {
-        dprintf("Bad line %d\n", line_n);
-        return;
+        size_t size = in->buffer_size*2;
+        if(size < cur + n)
+            size = cur + n;
+
+        uint8_t * buffer = (uint8_t*)memory_alloc(size, 64);
+        if(buffer == NULL) return false;
+        memcpy(buffer, keep, avail);
+        memory_free(in->buffer, in->buffer_size);
+        in->buffer = buffer;
+        in->buffer_size = size;
+    }
+    else
+        memmove(in->buffer, keep, avail);
+
+    if(in->mark)
+        in->mark = in->buffer;
+    in->cur = in->buffer + cur;
+    in->end = in->buffer + avail;
+
+    while((size_t)(in->end - in->cur) < n)
+    {
+        ssize_t ret;
+
+        if(in->feed)
+            ret = feed_read(in->feed, in->buffer + avail, in->buffer_size - avail);
+        else
+            ret = read(in->fd, in->buffer + avail, in->buffer_size - avail);
+        if(ret < 0 && errno == EINTR)
+            continue;
+        if(ret <= 0)
+            return false;
+        avail += ret;
+        in->end = in->buffer + avail;
     }
-    
-    memcpy((info->page_data+(line_n*info->line_bytes)), line, info->line_bytes);
+
+    return true;
 }
-#endif
-#ifdef QPDF_BACKEND
-int create_pdf_file(struct pdf_info * info, unsigned pagecount)
+
+// Make sure at least n bytes are available at in->cur
+static inline bool input_ensure(struct urf_input * in, size_t n)
 {
-    try {
-        info->pdf.emptyPDF();
-    } catch (...) {
-        return 1;
-    }
+    return ((size_t)(in->end - in->cur) >= n) || input_refill(in, n);
+}
 
-    info->pagecount = pagecount;
+static inline size_t input_read(struct urf_input * in, void * dst, size_t n)
+{
+    if(!input_ensure(in, n))
+        return 0;
+    memcpy(dst, in->cur, n);
+    in->cur += n;
+    return n;
+}
 
-    return 0;
+static inline bool input_skip(struct urf_input * in, size_t n)
+{
+    if(!input_ensure(in, n))
+        return false;
+    in->cur += n;
+    return true;
 }
 
-QPDFObjectHandle makeBox(double x1, double y1, double x2, double y2)
+/*
+ * input_mark() and input_rewind() let the decoder look ahead, pipes keep
+ * everything read in between in the buffer.
+ */
+static inline void input_mark(struct urf_input * in)
 {
-    QPDFObjectHandle ret=QPDFObjectHandle::newArray();
-    ret.appendItem(QPDFObjectHandle::newReal(x1));
-    ret.appendItem(QPDFObjectHandle::newReal(y1));
-    ret.appendItem(QPDFObjectHandle::newReal(x2));
-    ret.appendItem(QPDFObjectHandle::newReal(y2));
-    return ret;
+    in->mark = in->cur;
 }
 
-enum ColorSpace {
-    DEVICE_GRAY,
-    DEVICE_RGB,
-    DEVICE_CMYK
-};
+static inline void input_rewind(struct urf_input * in)
+{
+    in->cur = in->mark;
+    in->mark = NULL;
+}
 
-#define PRE_COMPRESS
-/* or temporarily store images?
-    if(cupsTempFile2(tempfile_name, 255) == NULL) die("Unable to create a temporary pdf file");
-    iprintf("Created temporary file '%s'\n", tempfile_name);
-*/
+static inline void input_unmark(struct urf_input * in)
+{
+    in->mark = NULL;
+}
 
-QPDFObjectHandle makeImage(QPDF &pdf, PointerHolder<Buffer> page_data, unsigned width, unsigned height, ColorSpace cs, unsigned bpc)
+/*
+ * Reader of its own over a mapped input, from offset on, to decode pages
+ * in parallel.  Releasing the mapping is left to in.
+ */
+void input_view(struct urf_input * view, const struct urf_input * in, size_t offset)
 {
-    QPDFObjectHandle ret = QPDFObjectHandle::newStream(&pdf);
+    memset(view, 0, sizeof(*view));
+    view->fd = in->fd;
+    view->map = in->map;
+    view->map_size = in->map_size;
+    view->map_released = in->map_size;
+    view->cur = in->map + offset;
+    view->end = in->map + in->map_size;
+}
 
-    std::map<std::string,QPDFObjectHandle> dict;
+// Drop the consumed part of a mapped input from the resident set
+void input_release(struct urf_input * in)
+{
+    const uint8_t * keep = in->mark ? in->mark : in->cur;
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t done;
 
-    dict["/Type"]=QPDFObjectHandle::newName("/XObject");
-    dict["/Subtype"]=QPDFObjectHandle::newName("/Image");
-    dict["/Width"]=QPDFObjectHandle::newInteger(width);
-    dict["/Height"]=QPDFObjectHandle::newInteger(height);
-    dict["/BitsPerComponent"]=QPDFObjectHandle::newInteger(bpc);
+    if(in->map == NULL)
+        return;
 
-    if (cs==DEVICE_GRAY) {
-        dict["/ColorSpace"]=QPDFObjectHandle::newName("/DeviceGray");
-    } else if (cs==DEVICE_RGB) {
-        dict["/ColorSpace"]=QPDFObjectHandle::newName("/DeviceRGB");
-    } else if (cs==DEVICE_CMYK) {
-        dict["/ColorSpace"]=QPDFObjectHandle::newName("/DeviceCMYK");
-    } else {
-        return QPDFObjectHandle();
+    done = (keep - in->map)/page_size*page_size;
+    if(done > in->map_released)
+    {
+        madvise(in->map + in->map_released, done - in->map_released, MADV_DONTNEED);
+        in->map_released = done;
     }
+}
 
-    ret.replaceDict(QPDFObjectHandle::newDictionary(dict));
+// Current offset in the input stream, for diagnostics
+off_t input_tell(struct urf_input * in)
+{
+    if(in->map)
+        return in->cur - in->map;
+    return in->buffer_offset + (in->cur - in->buffer);
+}
+
+//------------- Compression ---------------
 
-#ifdef PRE_COMPRESS
-    // we deliver already compressed content (instead of letting QPDFWriter do it), to avoid using excessive memory
-    Pl_Buffer psink("psink");
-    Pl_Flate pflate("pflate",&psink,Pl_Flate::a_deflate);
-    
-    pflate.write(page_data->getBuffer(),page_data->getSize());
-    pflate.finish();
-
-//    /Filter /FlateDecode
-//    /DecodeParms  [<</Predictor 1 /Colors 1[3] /BitsPerComponent $bits /Columns $x>>]  ??
-    ret.replaceStreamData(PointerHolder<Buffer>(psink.getBuffer()),
-                          QPDFObjectHandle::newName("/FlateDecode"),QPDFObjectHandle::newNull());
+/*
+ * The deflate engine is zlib, or libdeflate when built with
+ * LIBDEFLATE_ENGINE and the native zlib-ng API with ZLIBNG_ENGINE.
+ * libdeflate only compresses whole buffers, so its input is kept until
+ * deflate_stream_finish().
+ */
+#define DEFLATE_CHUNK (64*1024)
+#define DEFLATE_DEFAULT_LEVEL 6
+#define DEFLATE_FASTEST_LEVEL 1
+#define DEFLATE_LEVEL_ADAPTIVE -1   // urf-compression-level=adaptive
+#define DEFLATE_ADAPTIVE_MAX_LEVEL 9
+#define DEFLATE_DEFAULT_BUDGET 1000       // ms per page, urf-compression-budget
+#ifdef LIBDEFLATE_ENGINE
+#define DEFLATE_MAX_LEVEL 12
 #else
-    ret.replaceStreamData(page_data,QPDFObjectHandle::newNull(),QPDFObjectHandle::newNull());
+#define DEFLATE_MAX_LEVEL 9
 #endif
 
-    return ret;
-}
+#ifdef ZLIBNG_ENGINE
+// Only the prefix differs
+#define z_stream zng_stream
+#define deflateInit(strm, level) zng_deflateInit(strm, level)
+#define deflateReset(strm) zng_deflateReset(strm)
+#define deflateParams(strm, level, strategy) zng_deflateParams(strm, level, strategy)
+#define deflate(strm, flush) zng_deflate(strm, flush)
+#define deflateEnd(strm) zng_deflateEnd(strm)
+#endif
 
-void finish_page(struct pdf_info * info)
+// Receives compressed data as it is produced
+typedef void (*deflate_sink)(void * ctx, const uint8_t * data, size_t size);
+
+/*
+ * Streaming deflate, lines are pushed as soon as they are decoded so only
+ * the compressed page is kept in memory.  The engine state is kept from one
+ * stream to the next until deflate_stream_end().
+ */
+struct deflate_stream
 {
-    //Finish previous Page
-    if(!info->page_data.getPointer())
-        return;
+    bool ready;                 // the engine is initialized, must be zeroed at first
+    int level;
+    deflate_sink sink;
+    void * sink_ctx;
+#ifdef LIBDEFLATE_ENGINE
+    struct libdeflate_compressor * compressor;
+    image_buffer in;
+    image_buffer out;
+#else
+    z_stream zs;
+    uint8_t out[DEFLATE_CHUNK];
+#endif
+};
 
-    ColorSpace qpdf_cs = DEVICE_RGB;
-    if(info->page_colourspace == UNIRAST_COLOR_SPACE_GRAYSCALE_8BIT)
-      qpdf_cs = DEVICE_GRAY;
+#ifdef LIBDEFLATE_ENGINE
 
-    QPDFObjectHandle image = makeImage(info->pdf, info->page_data, info->width, info->height, qpdf_cs, 8);
-    if(!image.isInitialized()) die("Unable to load image data");
+int deflate_stream_begin(struct deflate_stream * ds, int level, deflate_sink sink, void * sink_ctx)
+{
+    ds->sink = sink;
+    ds->sink_ctx = sink_ctx;
+    ds->in.clear();
 
-    // add it
-    info->page.getKey("/Resources").getKey("/XObject").replaceKey("/I",image);
+    if(ds->ready && ds->level == level)
+        return 0;
+    if(ds->ready)
+        libdeflate_free_compressor(ds->compressor);
+    ds->ready = false;
 
-    // draw it
-    std::string content;
-    content.append(QUtil::double_to_string(info->page_width) + " 0 0 " + 
-                   QUtil::double_to_string(info->page_height) + " 0 0 cm\n");
-    content.append("/I Do\n");
-    info->page.getKey("/Contents").replaceStreamData(content,QPDFObjectHandle::newNull(),QPDFObjectHandle::newNull());
+    if((ds->compressor = libdeflate_alloc_compressor(level)) == NULL)
+        return 1;
+    ds->level = level;
+    ds->ready = true;
 
-    // bookkeeping
-    info->page_data = PointerHolder<Buffer>();
+    return 0;
 }
 
-int add_pdf_page(struct pdf_info * info, int pagen, unsigned width, unsigned height, int bpp, unsigned dpi,
-                 unsigned colourspace)
+int deflate_stream_write(struct deflate_stream * ds, const uint8_t * data, size_t size)
 {
     try {
-        finish_page(info); // any active
-
-        info->width = width;
-        info->height = height;
-        info->pixel_bytes = bpp/8;
-        info->line_bytes = (width*info->pixel_bytes);
-        info->bpp = bpp;
-        info->page_colourspace = colourspace;
-        info->page_data = PointerHolder<Buffer>(new Buffer(info->line_bytes*info->height));
-
-        QPDFObjectHandle page = QPDFObjectHandle::parse(
-            "<<"
-            "  /Type /Page"
-            "  /Resources <<"
-            "    /XObject << >> "
-            "  >>"
-            "  /MediaBox null "
-            "  /Contents null "
-            ">>");
-        page.replaceKey("/Contents",QPDFObjectHandle::newStream(&info->pdf)); // data will be provided later
-    
-        // Convert to pdf units
-        info->page_width=((double)info->width/dpi)*DEFAULT_PDF_UNIT;
-        info->page_height=((double)info->height/dpi)*DEFAULT_PDF_UNIT;
-        page.replaceKey("/MediaBox",makeBox(0,0,info->page_width,info->page_height));
-    
-        info->page = info->pdf.makeIndirectObject(page); // we want to keep a reference
-        info->pdf.addPage(info->page, false);
-    } catch (std::bad_alloc &ex) {
-        die("Unable to allocate page data");
+        ds->in.insert(ds->in.end(), data, data + size);
     } catch (...) {
         return 1;
     }
@@ -332,304 +653,5050 @@ int add_pdf_page(struct pdf_info * info, int pagen, unsigned width, unsigned hei
     return 0;
 }
 
-int close_pdf_file(struct pdf_info * info)
+int deflate_stream_finish(struct deflate_stream * ds)
 {
-    try {
-        finish_page(info); // any active
+    size_t size;
 
-        QPDFWriter output(info->pdf,NULL);
-        output.write();
+    try {
+        ds->out.resize(libdeflate_zlib_compress_bound(ds->compressor, ds->in.size()));
     } catch (...) {
         return 1;
     }
 
+    size = libdeflate_zlib_compress(ds->compressor, ds->in.data(), ds->in.size(), ds->out.data(), ds->out.size());
+    if(size == 0)
+        return 1;
+    ds->sink(ds->sink_ctx, ds->out.data(), size);
+    ds->in.clear();
+
     return 0;
 }
 
-void pdf_set_line(struct pdf_info * info, unsigned line_n, uint8_t line[])
+void deflate_stream_end(struct deflate_stream * ds)
+{
+    if(ds->ready)
+        libdeflate_free_compressor(ds->compressor);
+    ds->ready = false;
+    image_buffer().swap(ds->in);
+    image_buffer().swap(ds->out);
+}
+
+#else
+
+int deflate_stream_begin(struct deflate_stream * ds, int level, deflate_sink sink, void * sink_ctx)
 {
-    dprintf("pdf_set_line(%d)\n", line_n);
+    ds->sink = sink;
+    ds->sink_ctx = sink_ctx;
 
-    if(line_n > info->height)
+    if(ds->ready)
     {
-        dprintf("Bad line %d\n", line_n);
-        return;
+        if(deflateReset(&ds->zs) != Z_OK)
+            return 1;
+        if(ds->level != level && deflateParams(&ds->zs, level, Z_DEFAULT_STRATEGY) != Z_OK)
+            return 1;
+        ds->level = level;
+        return 0;
     }
-  
-    memcpy((info->page_data->getBuffer()+(line_n*info->line_bytes)), line, info->line_bytes);
-}
-#endif
 
-// Data are in network endianness
-struct urf_file_header {
-    char unirast[8];
-    uint32_t page_count;
-} __attribute__((__packed__));
+    memset(&ds->zs, 0, sizeof(ds->zs));
+    if(deflateInit(&ds->zs, level) != Z_OK)
+        return 1;
+    ds->level = level;
+    ds->ready = true;
 
-struct urf_page_header {
-    uint8_t bpp;
-    uint8_t colorspace;
-    uint8_t duplex;
-    uint8_t quality;
-    uint32_t unknown0;
-    uint32_t unknown1;
-    uint32_t width;
-    uint32_t height;
-    uint32_t dot_per_inch;
-    uint32_t unknown2;
-    uint32_t unknown3;
-} __attribute__((__packed__));
+    return 0;
+}
 
-int decode_raster(int fd, unsigned width, unsigned height, int bpp, struct pdf_info * info)
+static int deflate_stream_run(struct deflate_stream * ds, int flush)
 {
-    // We should be at raster start
-    int i, j;
-    unsigned cur_line = 0;
-    unsigned pos = 0;
-    uint8_t line_repeat_byte = 0;
-    unsigned line_repeat = 0;
-    int8_t packbit_code = 0;
-    int pixel_size = (bpp/8);
-    std::vector<uint8_t> pixel_container;
-    std::vector<uint8_t> line_container;
-
-    try {
-        pixel_container.resize(pixel_size);
-        line_container.resize(pixel_size*width);
-    } catch (...) {
-        die("Unable to allocate temporary storage");
-    }
+    int ret;
 
     do
     {
-        if(read(fd, &line_repeat_byte, 1) < 1)
-        {
-            dprintf("l%06d : line_repeat EOF at %lu\n", cur_line, lseek(fd, 0, SEEK_CUR));
+        ds->zs.next_out = ds->out;
+        ds->zs.avail_out = sizeof(ds->out);
+
+        ret = deflate(&ds->zs, flush);
+        if(ret == Z_STREAM_ERROR)
             return 1;
-        }
 
-        line_repeat = (unsigned)line_repeat_byte + 1;
+        if(ds->zs.avail_out < sizeof(ds->out))
+            ds->sink(ds->sink_ctx, ds->out, sizeof(ds->out) - ds->zs.avail_out);
+    }
+    while(ds->zs.avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
 
-        dprintf("l%06d : next actions for %d lines\n", cur_line, line_repeat);
+    return 0;
+}
+
+int deflate_stream_write(struct deflate_stream * ds, const uint8_t * data, size_t size)
+{
+    ds->zs.next_in = (uint8_t*)data;
+    ds->zs.avail_in = size;
+
+    return deflate_stream_run(ds, Z_NO_FLUSH);
+}
+
+int deflate_stream_finish(struct deflate_stream * ds)
+{
+    ds->zs.next_in = NULL;
+    ds->zs.avail_in = 0;
+
+    return deflate_stream_run(ds, Z_FINISH);
+}
+
+void deflate_stream_end(struct deflate_stream * ds)
+{
+    if(ds->ready)
+        deflateEnd(&ds->zs);
+    ds->ready = false;
+}
+
+#endif
+
+/*
+ * urf-compression-level=adaptive: pages are compressed at the level of the
+ * previous ones, one lower when a page took longer than the budget, one
+ * higher when a page left enough time for the next level.
+ */
+struct deflate_tuner
+{
+    uint64_t budget_ns;         // per page, 0 when the level is fixed
+    std::atomic<int> level;
+
+    deflate_tuner() : budget_ns(0), level(DEFLATE_DEFAULT_LEVEL) {}
+};
+
+static struct deflate_tuner default_tuner;
+static thread_local struct deflate_tuner * tuner = &default_tuner;
+
+// level is the one the page was compressed at, ns its compression time
+void deflate_tuner_update(unsigned number, int level, uint64_t ns)
+{
+    int next = level;
+
+    if(ns > tuner->budget_ns && level > DEFLATE_FASTEST_LEVEL)
+        next = level - 1;
+    else if(ns*3/2 < tuner->budget_ns && level < DEFLATE_ADAPTIVE_MAX_LEVEL)
+        next = level + 1;
+
+    // Pages still at an older level do not move it twice
+    if(next != level && tuner->level.compare_exchange_strong(level, next))
+        iprintf("Page %d took %.0f ms to compress, compression level %d from now\n", number, ns/1e6, next);
+}
+
+//------------- Predictors ---------------
+
+/*
+ * PNG predictors (PDF /Predictor 10-15): every line is prefixed by its
+ * filter type and stores differences to the left and/or upper neighbours,
+ * which deflate compresses much better on gradients and scans.
+ * The filter kernels only read raw samples so they vectorize cleanly.
+ */
+
+enum png_filter
+{
+    PNG_FILTER_NONE = 0,
+    PNG_FILTER_SUB = 1,
+    PNG_FILTER_UP = 2,
+    PNG_FILTER_AVERAGE = 3,
+    PNG_FILTER_PAETH = 4,
+    PNG_FILTER_ADAPTIVE = 5,   // best of the above for each line
+};
+
+#define PREDICTOR_OFF -1
+
+static void filter_sub(uint8_t * out, const uint8_t * line, size_t n, unsigned bpp)
+{
+    size_t i;
+
+    for(i = 0 ; i < bpp && i < n ; ++i)
+        out[i] = line[i];
+#ifdef __SSE2__
+    for(; i + 16 <= n ; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*)(line + i));
+        __m128i a = _mm_loadu_si128((const __m128i*)(line + i - bpp));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_sub_epi8(x, a));
+    }
+#endif
+    for(; i < n ; ++i)
+        out[i] = line[i] - line[i - bpp];
+}
+
+static void filter_up(uint8_t * out, const uint8_t * line, const uint8_t * prev, size_t n)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    for(; i + 16 <= n ; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*)(line + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(prev + i));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_sub_epi8(x, b));
+    }
+#endif
+    for(; i < n ; ++i)
+        out[i] = line[i] - prev[i];
+}
+
+static void filter_average(uint8_t * out, const uint8_t * line, const uint8_t * prev, size_t n, unsigned bpp)
+{
+    size_t i;
+
+    for(i = 0 ; i < bpp && i < n ; ++i)
+        out[i] = line[i] - (prev[i] >> 1);
+#ifdef __SSE2__
+    const __m128i one = _mm_set1_epi8(1);
+    for(; i + 16 <= n ; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*)(line + i));
+        __m128i a = _mm_loadu_si128((const __m128i*)(line + i - bpp));
+        __m128i b = _mm_loadu_si128((const __m128i*)(prev + i));
+        // pavgb rounds up, PNG wants (a+b)>>1
+        __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_sub_epi8(x, avg));
+    }
+#endif
+    for(; i < n ; ++i)
+        out[i] = line[i] - ((line[i - bpp] + prev[i]) >> 1);
+}
+
+static inline uint8_t paeth_predictor(int a, int b, int c)
+{
+    int pa = abs(b - c);
+    int pb = abs(a - c);
+    int pc = abs(a + b - 2*c);
+
+    if(pa <= pb && pa <= pc)
+        return a;
+    if(pb <= pc)
+        return b;
+    return c;
+}
+
+#ifdef __SSE2__
+// Paeth on 8 samples widened to 16 bits
+static inline __m128i paeth_epi16(__m128i a, __m128i b, __m128i c)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i pa = _mm_sub_epi16(b, c);
+    __m128i pb = _mm_sub_epi16(a, c);
+    __m128i pc = _mm_add_epi16(pa, pb);
+
+    pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+    pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+    pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+
+    __m128i not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+    __m128i use_c = _mm_cmpgt_epi16(pb, pc);
+    __m128i bc = _mm_or_si128(_mm_and_si128(use_c, c), _mm_andnot_si128(use_c, b));
+
+    return _mm_or_si128(_mm_and_si128(not_a, bc), _mm_andnot_si128(not_a, a));
+}
+#endif
+
+static void filter_paeth(uint8_t * out, const uint8_t * line, const uint8_t * prev, size_t n, unsigned bpp)
+{
+    size_t i;
+
+    for(i = 0 ; i < bpp && i < n ; ++i)
+        out[i] = line[i] - prev[i];
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for(; i + 16 <= n ; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*)(line + i));
+        __m128i a = _mm_loadu_si128((const __m128i*)(line + i - bpp));
+        __m128i b = _mm_loadu_si128((const __m128i*)(prev + i));
+        __m128i c = _mm_loadu_si128((const __m128i*)(prev + i - bpp));
+        __m128i lo = paeth_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+        __m128i hi = paeth_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_sub_epi8(x, _mm_packus_epi16(lo, hi)));
+    }
+#endif
+    for(; i < n ; ++i)
+        out[i] = line[i] - paeth_predictor(line[i - bpp], prev[i], prev[i - bpp]);
+}
+
+// Sum of the filtered bytes taken as signed values, the usual PNG heuristic
+static size_t filter_cost(const uint8_t * data, size_t n)
+{
+    size_t i = 0;
+    size_t cost = 0;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    for(; i + 16 <= n ; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*)(data + i));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_min_epu8(x, _mm_sub_epi8(zero, x)), zero));
+    }
+    cost = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif
+    for(; i < n ; ++i)
+        cost += data[i] < 128 ? data[i] : 256 - data[i];
+
+    return cost;
+}
+
+// /Predictor value announcing a filter in the image DecodeParms
+int pdf_predictor(int filter)
+{
+    return (filter == PNG_FILTER_ADAPTIVE) ? 15 : 10 + filter;
+}
+
+// Writes the filter type then the filtered line into out[0..n]
+static void png_filter_line(int filter, uint8_t * out, const uint8_t * line, const uint8_t * prev, size_t n, unsigned bpp)
+{
+    out[0] = filter;
+
+    switch(filter)
+    {
+        case PNG_FILTER_SUB:
+            filter_sub(out + 1, line, n, bpp);
+            break;
+        case PNG_FILTER_UP:
+            filter_up(out + 1, line, prev, n);
+            break;
+        case PNG_FILTER_AVERAGE:
+            filter_average(out + 1, line, prev, n, bpp);
+            break;
+        case PNG_FILTER_PAETH:
+            filter_paeth(out + 1, line, prev, n, bpp);
+            break;
+        default:
+            out[0] = PNG_FILTER_NONE;
+            memcpy(out + 1, line, n);
+            break;
+    }
+}
+
+//------------- CCITT G4 ---------------
+
+struct g4_code
+{
+    uint16_t code;
+    uint8_t bits;
+};
+
+// White run lengths 0-63, then makeup codes for 64-2560 by steps of 64
+static const struct g4_code g4_white_codes[] =
+{
+    { 0x035,  8 }, { 0x007,  6 }, { 0x007,  4 }, { 0x008,  4 },
+    { 0x00b,  4 }, { 0x00c,  4 }, { 0x00e,  4 }, { 0x00f,  4 },
+    { 0x013,  5 }, { 0x014,  5 }, { 0x007,  5 }, { 0x008,  5 },
+    { 0x008,  6 }, { 0x003,  6 }, { 0x034,  6 }, { 0x035,  6 },
+    { 0x02a,  6 }, { 0x02b,  6 }, { 0x027,  7 }, { 0x00c,  7 },
+    { 0x008,  7 }, { 0x017,  7 }, { 0x003,  7 }, { 0x004,  7 },
+    { 0x028,  7 }, { 0x02b,  7 }, { 0x013,  7 }, { 0x024,  7 },
+    { 0x018,  7 }, { 0x002,  8 }, { 0x003,  8 }, { 0x01a,  8 },
+    { 0x01b,  8 }, { 0x012,  8 }, { 0x013,  8 }, { 0x014,  8 },
+    { 0x015,  8 }, { 0x016,  8 }, { 0x017,  8 }, { 0x028,  8 },
+    { 0x029,  8 }, { 0x02a,  8 }, { 0x02b,  8 }, { 0x02c,  8 },
+    { 0x02d,  8 }, { 0x004,  8 }, { 0x005,  8 }, { 0x00a,  8 },
+    { 0x00b,  8 }, { 0x052,  8 }, { 0x053,  8 }, { 0x054,  8 },
+    { 0x055,  8 }, { 0x024,  8 }, { 0x025,  8 }, { 0x058,  8 },
+    { 0x059,  8 }, { 0x05a,  8 }, { 0x05b,  8 }, { 0x04a,  8 },
+    { 0x04b,  8 }, { 0x032,  8 }, { 0x033,  8 }, { 0x034,  8 },
+    { 0x01b,  5 }, { 0x012,  5 }, { 0x017,  6 }, { 0x037,  7 },
+    { 0x036,  8 }, { 0x037,  8 }, { 0x064,  8 }, { 0x065,  8 },
+    { 0x068,  8 }, { 0x067,  8 }, { 0x0cc,  9 }, { 0x0cd,  9 },
+    { 0x0d2,  9 }, { 0x0d3,  9 }, { 0x0d4,  9 }, { 0x0d5,  9 },
+    { 0x0d6,  9 }, { 0x0d7,  9 }, { 0x0d8,  9 }, { 0x0d9,  9 },
+    { 0x0da,  9 }, { 0x0db,  9 }, { 0x098,  9 }, { 0x099,  9 },
+    { 0x09a,  9 }, { 0x018,  6 }, { 0x09b,  9 }, { 0x008, 11 },
+    { 0x00c, 11 }, { 0x00d, 11 }, { 0x012, 12 }, { 0x013, 12 },
+    { 0x014, 12 }, { 0x015, 12 }, { 0x016, 12 }, { 0x017, 12 },
+    { 0x01c, 12 }, { 0x01d, 12 }, { 0x01e, 12 }, { 0x01f, 12 }
+};
+
+// Black run lengths, same layout
+static const struct g4_code g4_black_codes[] =
+{
+    { 0x037, 10 }, { 0x002,  3 }, { 0x003,  2 }, { 0x002,  2 },
+    { 0x003,  3 }, { 0x003,  4 }, { 0x002,  4 }, { 0x003,  5 },
+    { 0x005,  6 }, { 0x004,  6 }, { 0x004,  7 }, { 0x005,  7 },
+    { 0x007,  7 }, { 0x004,  8 }, { 0x007,  8 }, { 0x018,  9 },
+    { 0x017, 10 }, { 0x018, 10 }, { 0x008, 10 }, { 0x067, 11 },
+    { 0x068, 11 }, { 0x06c, 11 }, { 0x037, 11 }, { 0x028, 11 },
+    { 0x017, 11 }, { 0x018, 11 }, { 0x0ca, 12 }, { 0x0cb, 12 },
+    { 0x0cc, 12 }, { 0x0cd, 12 }, { 0x068, 12 }, { 0x069, 12 },
+    { 0x06a, 12 }, { 0x06b, 12 }, { 0x0d2, 12 }, { 0x0d3, 12 },
+    { 0x0d4, 12 }, { 0x0d5, 12 }, { 0x0d6, 12 }, { 0x0d7, 12 },
+    { 0x06c, 12 }, { 0x06d, 12 }, { 0x0da, 12 }, { 0x0db, 12 },
+    { 0x054, 12 }, { 0x055, 12 }, { 0x056, 12 }, { 0x057, 12 },
+    { 0x064, 12 }, { 0x065, 12 }, { 0x052, 12 }, { 0x053, 12 },
+    { 0x024, 12 }, { 0x037, 12 }, { 0x038, 12 }, { 0x027, 12 },
+    { 0x028, 12 }, { 0x058, 12 }, { 0x059, 12 }, { 0x02b, 12 },
+    { 0x02c, 12 }, { 0x05a, 12 }, { 0x066, 12 }, { 0x067, 12 },
+    { 0x00f, 10 }, { 0x0c8, 12 }, { 0x0c9, 12 }, { 0x05b, 12 },
+    { 0x033, 12 }, { 0x034, 12 }, { 0x035, 12 }, { 0x06c, 13 },
+    { 0x06d, 13 }, { 0x04a, 13 }, { 0x04b, 13 }, { 0x04c, 13 },
+    { 0x04d, 13 }, { 0x072, 13 }, { 0x073, 13 }, { 0x074, 13 },
+    { 0x075, 13 }, { 0x076, 13 }, { 0x077, 13 }, { 0x052, 13 },
+    { 0x053, 13 }, { 0x054, 13 }, { 0x055, 13 }, { 0x05a, 13 },
+    { 0x05b, 13 }, { 0x064, 13 }, { 0x065, 13 }, { 0x008, 11 },
+    { 0x00c, 11 }, { 0x00d, 11 }, { 0x012, 12 }, { 0x013, 12 },
+    { 0x014, 12 }, { 0x015, 12 }, { 0x016, 12 }, { 0x017, 12 },
+    { 0x01c, 12 }, { 0x01d, 12 }, { 0x01e, 12 }, { 0x01f, 12 }
+};
+
+// Vertical mode codes for a1 - b1 from -3 to 3
+static const struct g4_code g4_vertical_codes[] =
+{
+    { 0x002,  7 }, { 0x002,  6 }, { 0x002,  3 }, { 0x001,  1 },
+    { 0x003,  3 }, { 0x003,  6 }, { 0x003,  7 }
+};
+
+#define G4_CHUNK 4096
+
+// Average run length under which G4 codes get longer than 1-bit Flate
+#define G4_MIN_RUN 8
+
+/*
+ * CCITT T.6 (Group 4) encoder for 1-bit lines where 1 is white, as in
+ * DeviceGray.  Every line is coded against the previous one, the first
+ * against an imaginary white line.
+ */
+struct g4_encoder
+{
+    unsigned columns;
+    std::vector<uint8_t> ref;   // reference line
+    deflate_sink sink;
+    void * sink_ctx;
+    uint32_t bits;              // pending bits are the low bit_count ones
+    unsigned bit_count;
+    size_t out_size;
+    uint8_t out[G4_CHUNK];
+};
+
+static inline void g4_put(struct g4_encoder * g4, unsigned code, unsigned bits)
+{
+    g4->bits = (g4->bits << bits) | code;
+    g4->bit_count += bits;
+
+    while(g4->bit_count >= 8)
+    {
+        g4->bit_count -= 8;
+        g4->out[g4->out_size++] = g4->bits >> g4->bit_count;
+        if(g4->out_size == G4_CHUNK)
+        {
+            g4->sink(g4->sink_ctx, g4->out, g4->out_size);
+            g4->out_size = 0;
+        }
+    }
+}
+
+static void g4_put_run(struct g4_encoder * g4, const struct g4_code * codes, unsigned run)
+{
+    while(run >= 2560 + 64)
+    {
+        g4_put(g4, codes[63 + 2560/64].code, codes[63 + 2560/64].bits);
+        run -= 2560;
+    }
+
+    if(run >= 64)
+    {
+        g4_put(g4, codes[63 + run/64].code, codes[63 + run/64].bits);
+        run %= 64;
+    }
+
+    g4_put(g4, codes[run].code, codes[run].bits);
+}
+
+static inline unsigned g4_pixel(const uint8_t * line, unsigned x)
+{
+    return (line[x >> 3] >> (7 - (x & 7))) & 1;
+}
+
+// First changing element after x, x = -1 is the imaginary white pixel
+static unsigned g4_next_change(const uint8_t * line, int x, unsigned columns)
+{
+    unsigned color = (x < 0) ? 1 : g4_pixel(line, x);
+    uint8_t same = color ? 0xFF : 0x00;
+    unsigned p = x + 1;
+
+    while(p < columns)
+    {
+        // Skip whole bytes of the current color
+        if((p & 7) == 0)
+        {
+            while(p + 8 <= columns && line[p >> 3] == same)
+                p += 8;
+            if(p >= columns)
+                break;
+        }
+
+        if(g4_pixel(line, p) != color)
+            return p;
+        ++p;
+    }
+
+    return columns;
+}
+
+int g4_begin(struct g4_encoder * g4, unsigned columns, deflate_sink sink, void * sink_ctx)
+{
+    g4->columns = columns;
+    g4->sink = sink;
+    g4->sink_ctx = sink_ctx;
+    g4->bits = 0;
+    g4->bit_count = 0;
+    g4->out_size = 0;
+
+    try {
+        g4->ref.assign((columns + 7)/8 + 1, 0xFF);
+    } catch (...) {
+        return 1;
+    }
+
+    return 0;
+}
+
+void g4_write(struct g4_encoder * g4, const uint8_t * line)
+{
+    const uint8_t * ref = &g4->ref[0];
+    unsigned columns = g4->columns;
+    unsigned color = 1;
+    int a0 = -1;
+
+    while(a0 < (int)columns)
+    {
+        unsigned a1 = g4_next_change(line, a0, columns);
+        unsigned b1 = g4_next_change(ref, a0, columns);
+        unsigned b2;
+
+        // b1 must have the opposite color of a0
+        if(b1 < columns && g4_pixel(ref, b1) == color)
+            b1 = g4_next_change(ref, b1, columns);
+        b2 = (b1 < columns) ? g4_next_change(ref, b1, columns) : columns;
+
+        if(b2 < a1)
+        {
+            // Pass mode
+            g4_put(g4, 0x1, 4);
+            a0 = b2;
+        }
+        else if(a1 + 3 >= b1 && b1 + 3 >= a1)
+        {
+            const struct g4_code * v = &g4_vertical_codes[3 + (int)a1 - (int)b1];
+            g4_put(g4, v->code, v->bits);
+            a0 = a1;
+            color ^= 1;
+        }
+        else
+        {
+            // Horizontal mode, two runs starting with the color of a0
+            unsigned a2 = (a1 < columns) ? g4_next_change(line, a1, columns) : columns;
+            unsigned start = (a0 < 0) ? 0 : a0;
+
+            g4_put(g4, 0x1, 3);
+            g4_put_run(g4, color ? g4_white_codes : g4_black_codes, a1 - start);
+            g4_put_run(g4, color ? g4_black_codes : g4_white_codes, a2 - a1);
+            a0 = a2;
+        }
+    }
+
+    memcpy(&g4->ref[0], line, (columns + 7)/8);
+}
+
+void g4_finish(struct g4_encoder * g4)
+{
+    // EOFB, then pad the last byte
+    g4_put(g4, 0x001, 12);
+    g4_put(g4, 0x001, 12);
+    if(g4->bit_count)
+        g4_put(g4, 0, 8 - g4->bit_count);
+
+    if(g4->out_size)
+        g4->sink(g4->sink_ctx, g4->out, g4->out_size);
+    g4->out_size = 0;
+}
+
+//------------- JPEG ---------------
+
+#define JPEG_DEFAULT_QUALITY 85
+
+/*
+ * DCTDecode images through libjpeg, written to a deflate_sink like the
+ * other encoders.  The compressor is kept from one image to the next
+ * until jpeg_stream_end().
+ *
+ * No exception may cross the C frames of libjpeg: its errors and those of
+ * the sink longjmp() back to the jpeg_stream function that called it,
+ * which destroys the compressor and dies from there.
+ */
+struct jpeg_failure
+{
+    struct jpeg_error_mgr mgr;  // first, cinfo->err points to it
+    jmp_buf jump;               // set before each call into libjpeg
+    char message[JMSG_LENGTH_MAX];
+};
+
+struct jpeg_stream
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_failure jerr;
+    struct jpeg_destination_mgr dest;
+    bool ready;                 // cinfo is created, must be zeroed at first
+    deflate_sink sink;
+    void * sink_ctx;
+    uint8_t out[DEFLATE_CHUNK];
+};
+
+// libjpeg only fails on internal or allocation errors when compressing
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+    struct jpeg_failure * jerr = (struct jpeg_failure *)cinfo->err;
+
+    (*cinfo->err->format_message)(cinfo, jerr->message);
+    longjmp(jerr->jump, 1);
+}
+
+// Warnings go to the job log, not stderr
+static void jpeg_output_message(j_common_ptr cinfo)
+{
+    char message[JMSG_LENGTH_MAX];
+
+    (*cinfo->err->format_message)(cinfo, message);
+    iprintf("libjpeg: %s\n", message);
+}
+
+static void jpeg_sink(struct jpeg_stream * js, const uint8_t * data, size_t size)
+{
+    bool failed = false;
+
+    try {
+        js->sink(js->sink_ctx, data, size);
+    } catch (std::exception & e) {
+        snprintf(js->jerr.message, sizeof(js->jerr.message), "%s", e.what());
+        failed = true;
+    }
+    if(failed)
+        longjmp(js->jerr.jump, 1);
+}
+
+static void jpeg_init_destination(j_compress_ptr cinfo)
+{
+    struct jpeg_stream * js = (struct jpeg_stream *)cinfo->client_data;
+
+    js->dest.next_output_byte = js->out;
+    js->dest.free_in_buffer = sizeof(js->out);
+}
+
+static boolean jpeg_empty_output_buffer(j_compress_ptr cinfo)
+{
+    struct jpeg_stream * js = (struct jpeg_stream *)cinfo->client_data;
+
+    jpeg_sink(js, js->out, sizeof(js->out));
+    jpeg_init_destination(cinfo);
+
+    return TRUE;
+}
+
+static void jpeg_term_destination(j_compress_ptr cinfo)
+{
+    struct jpeg_stream * js = (struct jpeg_stream *)cinfo->client_data;
+
+    if(js->dest.free_in_buffer < sizeof(js->out))
+        jpeg_sink(js, js->out, sizeof(js->out) - js->dest.free_in_buffer);
+}
+
+void jpeg_stream_end(struct jpeg_stream * js)
+{
+    if(js->ready)
+        jpeg_destroy_compress(&js->cinfo);
+    js->ready = false;
+}
+
+// Called back from a longjmp(), the compressor is left in any state
+static void jpeg_stream_fail(struct jpeg_stream * js)
+{
+    jpeg_stream_end(js);
+    die(js->jerr.message);
+}
+
+// Gray or RGB images with 8-bit samples
+int jpeg_stream_begin(struct jpeg_stream * js, unsigned columns, unsigned rows, unsigned components, int quality,
+                      deflate_sink sink, void * sink_ctx)
+{
+    js->sink = sink;
+    js->sink_ctx = sink_ctx;
+
+    if(setjmp(js->jerr.jump))
+        jpeg_stream_fail(js);
+
+    if(!js->ready)
+    {
+        js->cinfo.err = jpeg_std_error(&js->jerr.mgr);
+        js->jerr.mgr.error_exit = jpeg_error_exit;
+        js->jerr.mgr.output_message = jpeg_output_message;
+        jpeg_create_compress(&js->cinfo);
+        js->ready = true;
+        js->cinfo.client_data = js;
+        js->dest.init_destination = jpeg_init_destination;
+        js->dest.empty_output_buffer = jpeg_empty_output_buffer;
+        js->dest.term_destination = jpeg_term_destination;
+        js->cinfo.dest = &js->dest;
+    }
+
+    js->cinfo.image_width = columns;
+    js->cinfo.image_height = rows;
+    js->cinfo.input_components = components;
+    js->cinfo.in_color_space = (components == 1) ? JCS_GRAYSCALE : JCS_RGB;
+    jpeg_set_defaults(&js->cinfo);
+    jpeg_set_quality(&js->cinfo, quality, TRUE);
+    jpeg_start_compress(&js->cinfo, TRUE);
+
+    return 0;
+}
+
+void jpeg_stream_write(struct jpeg_stream * js, const uint8_t * line)
+{
+    JSAMPROW row = (JSAMPROW)line;
+
+    if(setjmp(js->jerr.jump))
+        jpeg_stream_fail(js);
+
+    jpeg_write_scanlines(&js->cinfo, &row, 1);
+}
+
+void jpeg_stream_finish(struct jpeg_stream * js)
+{
+    if(setjmp(js->jerr.jump))
+        jpeg_stream_fail(js);
+
+    jpeg_finish_compress(&js->cinfo);
+}
+
+//------------- Image encoder ---------------
+
+enum image_encoding
+{
+    ENCODING_FLATE,             // raw lines, deflated
+    ENCODING_RLE,               // lines already in RunLengthDecode format
+    ENCODING_RLE_FLATE,         // RunLengthDecode lines, deflated
+    ENCODING_CCITT,             // 1-bit lines, CCITT G4
+    ENCODING_DCT,               // raw lines, JPEG
+    ENCODING_PWG,               // lines already in PWG Raster format, urftopwg
+};
+
+#define RLE_EOD 128
+
+// Bands of these encodings hold RunLengthDecode lines instead of raw ones
+static inline bool rle_encoding(int encoding)
+{
+    return encoding == ENCODING_RLE || encoding == ENCODING_RLE_FLATE;
+}
+
+// Encodings going through deflate_stream
+static inline bool deflate_encoding(int encoding)
+{
+    return encoding == ENCODING_FLATE || encoding == ENCODING_RLE_FLATE;
+}
+
+// Worst case size of a line in RunLengthDecode format
+static inline size_t rle_line_bound(size_t line_bytes)
+{
+    return line_bytes + line_bytes/64 + 16;
+}
+
+// Worst case size of a PWG Raster line: a code byte before each pixel
+static inline size_t pwg_line_bound(size_t line_bytes, unsigned width)
+{
+    return line_bytes + width;
+}
+
+// Deflate stream, optionally behind a PNG predictor, G4 for 1-bit images or JPEG
+struct image_encoder
+{
+    struct deflate_stream deflate;
+    struct g4_encoder g4;
+    struct jpeg_stream jpeg;
+    int encoding;               // enum image_encoding
+    deflate_sink sink;          // output of ENCODING_RLE and ENCODING_PWG
+    void * sink_ctx;
+    int predictor;              // enum png_filter or PREDICTOR_OFF
+    unsigned pixel_bytes;
+    size_t line_bytes;
+    std::vector<uint8_t> prev;  // previous raw line
+    std::vector<uint8_t> best;
+    std::vector<uint8_t> candidate;
+};
+
+// rows are only used by JPEG, quality is the JPEG quality or the deflate level
+int image_encoder_begin(struct image_encoder * enc, int encoding, int predictor, unsigned pixel_bytes, unsigned columns,
+                        unsigned rows, size_t line_bytes, int quality, deflate_sink sink, void * sink_ctx)
+{
+    enc->encoding = encoding;
+    enc->sink = sink;
+    enc->sink_ctx = sink_ctx;
+    enc->predictor = (encoding == ENCODING_FLATE) ? predictor : PREDICTOR_OFF;
+    enc->pixel_bytes = pixel_bytes;
+    enc->line_bytes = line_bytes;
+
+    if(encoding == ENCODING_RLE || encoding == ENCODING_PWG)
+        return 0;
+    if(encoding == ENCODING_CCITT)
+        return g4_begin(&enc->g4, columns, sink, sink_ctx);
+    if(encoding == ENCODING_DCT)
+        return jpeg_stream_begin(&enc->jpeg, columns, rows, pixel_bytes, quality, sink, sink_ctx);
+
+    if(enc->predictor != PREDICTOR_OFF)
+    {
+        try {
+            enc->prev.assign(line_bytes, 0);
+            enc->best.resize(line_bytes + 1);
+            enc->candidate.resize(line_bytes + 1);
+        } catch (...) {
+            return 1;
+        }
+    }
+
+    return deflate_stream_begin(&enc->deflate, quality, sink, sink_ctx);
+}
+
+// Returns the filter type byte followed by the filtered line
+static const uint8_t * image_encoder_filter(struct image_encoder * enc, const uint8_t * line, const uint8_t * prev)
+{
+    int filter;
+    size_t cost, best_cost;
+
+    if(enc->predictor != PNG_FILTER_ADAPTIVE)
+    {
+        png_filter_line(enc->predictor, &enc->best[0], line, prev, enc->line_bytes, enc->pixel_bytes);
+        return &enc->best[0];
+    }
+
+    png_filter_line(PNG_FILTER_NONE, &enc->best[0], line, prev, enc->line_bytes, enc->pixel_bytes);
+    best_cost = filter_cost(line, enc->line_bytes);
+
+    for(filter = PNG_FILTER_SUB ; filter <= PNG_FILTER_PAETH && best_cost > 0 ; ++filter)
+    {
+        png_filter_line(filter, &enc->candidate[0], line, prev, enc->line_bytes, enc->pixel_bytes);
+        cost = filter_cost(&enc->candidate[1], enc->line_bytes);
+        if(cost < best_cost)
+        {
+            best_cost = cost;
+            enc->best.swap(enc->candidate);
+        }
+    }
+
+    return &enc->best[0];
+}
+
+// Encode count copies of line, size only differs from line_bytes for RLE and PWG lines
+int image_encoder_write(struct image_encoder * enc, const uint8_t * line, size_t size, unsigned count)
+{
+    const uint8_t * out;
+    unsigned i;
+
+    if(count == 0)
+        return 0;
+
+    if(enc->encoding == ENCODING_PWG)
+    {
+        // PWG lines start with their repeat count, up to 256
+        while(count > 0)
+        {
+            uint8_t repeat = ((count > 256) ? 256 : count) - 1;
+
+            enc->sink(enc->sink_ctx, &repeat, 1);
+            enc->sink(enc->sink_ctx, line, size);
+            count -= repeat + 1;
+        }
+        return 0;
+    }
+
+    if(enc->encoding == ENCODING_RLE)
+    {
+        for(i = 0 ; i < count ; ++i)
+            enc->sink(enc->sink_ctx, line, size);
+        return 0;
+    }
+
+    if(enc->encoding == ENCODING_CCITT)
+    {
+        for(i = 0 ; i < count ; ++i)
+            g4_write(&enc->g4, line);
+        return 0;
+    }
+
+    if(enc->encoding == ENCODING_DCT)
+    {
+        for(i = 0 ; i < count ; ++i)
+            jpeg_stream_write(&enc->jpeg, line);
+        return 0;
+    }
+
+    if(enc->predictor == PREDICTOR_OFF)
+    {
+        for(i = 0 ; i < count ; ++i)
+            if(deflate_stream_write(&enc->deflate, line, size) != 0) return 1;
+        return 0;
+    }
+
+    out = image_encoder_filter(enc, line, &enc->prev[0]);
+    if(deflate_stream_write(&enc->deflate, out, enc->line_bytes + 1) != 0) return 1;
+
+    // Repeats all see themselves as previous line, filter them once
+    if(count > 1)
+    {
+        out = image_encoder_filter(enc, line, line);
+        for(i = 1 ; i < count ; ++i)
+            if(deflate_stream_write(&enc->deflate, out, enc->line_bytes + 1) != 0) return 1;
+    }
+
+    memcpy(&enc->prev[0], line, enc->line_bytes);
+
+    return 0;
+}
+
+int image_encoder_finish(struct image_encoder * enc)
+{
+    static const uint8_t eod = RLE_EOD;
+
+    if(enc->encoding == ENCODING_RLE)
+    {
+        enc->sink(enc->sink_ctx, &eod, 1);
+        return 0;
+    }
+
+    if(enc->encoding == ENCODING_PWG)
+        return 0;
+
+    if(enc->encoding == ENCODING_CCITT)
+    {
+        g4_finish(&enc->g4);
+        return 0;
+    }
+
+    if(enc->encoding == ENCODING_DCT)
+    {
+        jpeg_stream_finish(&enc->jpeg);
+        return 0;
+    }
+
+    if(enc->encoding == ENCODING_RLE_FLATE && deflate_stream_write(&enc->deflate, &eod, 1) != 0)
+        return 1;
+
+    return deflate_stream_finish(&enc->deflate);
+}
+
+// Zero initialized encoders are reused by image_encoder_begin() until then
+void image_encoder_end(struct image_encoder * enc)
+{
+    deflate_stream_end(&enc->deflate);
+    jpeg_stream_end(&enc->jpeg);
+}
+
+//------------- Options ---------------
+
+/*
+ * Job options come from the CUPS option string (argv[5]), some of them
+ * default to an environment variable so they can be set for the whole
+ * server.
+ */
+// Lines per strip of PCLm pages, printers list the ones they prefer in pclm-strip-height-preferred
+#define PCLM_STRIP_HEIGHT 16
+
+struct urf_options
+{
+    unsigned threads;   // parallel deflate workers, 1 compresses each page as a whole
+    int predictor;      // PNG predictor, enum png_filter or PREDICTOR_OFF
+    int encoding;       // enum image_encoding
+    int gray;           // enum gray_mode
+    int bilevel;        // enum bilevel_mode
+    bool keep_16bit;    // 16-bit samples are kept, not reduced to 8 bits
+    bool stats;         // job statistics on stderr
+    unsigned max_dpi;   // pages above are downsampled, 0 for no limit
+    int jpeg;           // enum jpeg_mode
+    int jpeg_quality;   // 1 to 100
+    int compression_level;      // deflate level or DEFLATE_LEVEL_ADAPTIVE
+    unsigned compression_budget;        // ms per page with DEFLATE_LEVEL_ADAPTIVE
+    bool dedup;         // pages repeating an earlier raster reuse its images
+    unsigned copies;    // of each page, from the copies argument
+    bool collate;       // copies of the whole document instead of each page
+    int output;         // enum output_format, from the program name
+    bool rows;          // the rows of every page go to a callback, see band_callbacks()
+    unsigned pclm_strip_height;
+    uint64_t max_memory;        // budget of the job in bytes, 0 for no limit
+};
+
+enum output_format
+{
+    OUTPUT_PDF,
+    OUTPUT_PWG,         // PWG Raster, when run as urftopwg
+    OUTPUT_PCLM         // PCLm, when run as urftopclm
+};
+
+enum bilevel_mode
+{
+    BILEVEL_CCITT,      // black and white pages go 1-bit, G4 unless dithered
+    BILEVEL_FLATE,      // 1-bit Flate
+    BILEVEL_NEVER
+};
+
+enum gray_mode
+{
+    GRAY_AUTO,          // neutral RGB pages are stored as DeviceGray
+    GRAY_ALWAYS,        // every RGB page is converted to gray
+    GRAY_NEVER
+};
+
+enum jpeg_mode
+{
+    JPEG_NEVER,
+    JPEG_AUTO,          // pages looking like photos are stored as JPEG
+    JPEG_ALWAYS         // every 8-bit gray or RGB page
+};
+
+typedef std::map<std::string, std::string> option_map;
+
+// Split "name=value name2='quoted value' name3 noname4" like cupsParseOptions()
+option_map parse_option_string(const char * str)
+{
+    option_map options;
+    const char * p = str;
+
+    while(p && *p)
+    {
+        std::string name, value;
+
+        while(*p == ' ' || *p == '\t' || *p == ',')
+            ++p;
+        while(*p && *p != '=' && *p != ' ' && *p != '\t')
+            name += *p++;
+        if(name.empty())
+            break;
+
+        if(*p == '=')
+        {
+            ++p;
+            while(*p && *p != ' ' && *p != '\t')
+            {
+                if(*p == '\'' || *p == '"')
+                {
+                    char quote = *p++;
+                    while(*p && *p != quote)
+                    {
+                        if(*p == '\\' && p[1])
+                            ++p;
+                        value += *p++;
+                    }
+                    if(*p)
+                        ++p;
+                }
+                else
+                {
+                    if(*p == '\\' && p[1])
+                        ++p;
+                    value += *p++;
+                }
+            }
+        }
+        else if(name.compare(0, 2, "no") == 0)
+        {
+            name.erase(0, 2);
+            value = "false";
+        }
+        else
+            value = "true";
+
+        options[name] = value;
+    }
+
+    return options;
+}
+
+// Job option first, then environment variable, NULL if neither is set
+const char * get_option(const option_map & options, const char * name, const char * env)
+{
+    option_map::const_iterator it = options.find(name);
+
+    if(it != options.end())
+        return it->second.c_str();
+    if(env)
+        return getenv(env);
+
+    return NULL;
+}
+
+void parse_options(struct urf_options * options, const char * str)
+{
+    option_map map = parse_option_string(str);
+    const char * value;
+
+    options->threads = 1;
+    if((value = get_option(map, "urf-threads", "URFTOPDF_THREADS")) != NULL)
+    {
+        // 0 means one worker per CPU
+        options->threads = strtoul(value, NULL, 10);
+        if(options->threads == 0)
+            options->threads = std::thread::hardware_concurrency();
+        if(options->threads == 0)
+            options->threads = 1;
+    }
+
+    options->predictor = PREDICTOR_OFF;
+    if((value = get_option(map, "urf-predictor", "URFTOPDF_PREDICTOR")) != NULL)
+    {
+        // indexed by enum png_filter, "none" turns predictors off
+        static const char * const names[] = { "none", "sub", "up", "average", "paeth", "adaptive" };
+        unsigned i;
+
+        for(i = PNG_FILTER_SUB ; i < sizeof(names)/sizeof(names[0]) ; ++i)
+            if(strcmp(value, names[i]) == 0)
+                options->predictor = i;
+        if(strcmp(value, "true") == 0)
+            options->predictor = PNG_FILTER_ADAPTIVE;
+    }
+
+    options->encoding = ENCODING_FLATE;
+    if((value = get_option(map, "urf-image-encoding", "URFTOPDF_IMAGE_ENCODING")) != NULL)
+    {
+        // indexed by enum image_encoding
+        static const char * const names[] = { "flate", "rle", "rle-flate" };
+        unsigned i;
+
+        for(i = 0 ; i < sizeof(names)/sizeof(names[0]) ; ++i)
+            if(strcmp(value, names[i]) == 0)
+                options->encoding = i;
+    }
+
+    options->gray = GRAY_AUTO;
+    if((value = get_option(map, "urf-gray", "URFTOPDF_GRAY")) != NULL)
+    {
+        if(strcmp(value, "always") == 0 || strcmp(value, "true") == 0)
+            options->gray = GRAY_ALWAYS;
+        else if(strcmp(value, "never") == 0 || strcmp(value, "false") == 0)
+            options->gray = GRAY_NEVER;
+    }
+
+    options->bilevel = BILEVEL_CCITT;
+    if((value = get_option(map, "urf-bilevel", "URFTOPDF_BILEVEL")) != NULL)
+    {
+        if(strcmp(value, "flate") == 0)
+            options->bilevel = BILEVEL_FLATE;
+        else if(strcmp(value, "never") == 0 || strcmp(value, "false") == 0)
+            options->bilevel = BILEVEL_NEVER;
+    }
+
+    options->keep_16bit = false;
+    if((value = get_option(map, "urf-16bit", "URFTOPDF_16BIT")) != NULL)
+    {
+        options->keep_16bit = (strcmp(value, "keep") == 0 || strcmp(value, "true") == 0);
+    }
+
+    options->max_dpi = 0;
+    if((value = get_option(map, "urf-max-dpi", "URFTOPDF_MAX_DPI")) != NULL)
+    {
+        options->max_dpi = strtoul(value, NULL, 10);
+    }
+
+    options->jpeg = JPEG_NEVER;
+    if((value = get_option(map, "urf-jpeg", "URFTOPDF_JPEG")) != NULL)
+    {
+        if(strcmp(value, "auto") == 0 || strcmp(value, "true") == 0)
+            options->jpeg = JPEG_AUTO;
+        else if(strcmp(value, "always") == 0)
+            options->jpeg = JPEG_ALWAYS;
+    }
+
+    options->jpeg_quality = JPEG_DEFAULT_QUALITY;
+    if((value = get_option(map, "urf-jpeg-quality", "URFTOPDF_JPEG_QUALITY")) != NULL)
+    {
+        options->jpeg_quality = atoi(value);
+        if(options->jpeg_quality < 1)
+            options->jpeg_quality = 1;
+        else if(options->jpeg_quality > 100)
+            options->jpeg_quality = 100;
+    }
+
+    options->compression_level = DEFLATE_DEFAULT_LEVEL;
+    if((value = get_option(map, "urf-compression-level", "URFTOPDF_COMPRESSION_LEVEL")) != NULL)
+    {
+        if(strcmp(value, "fastest") == 0)
+            options->compression_level = DEFLATE_FASTEST_LEVEL;
+        else if(strcmp(value, "best") == 0)
+            options->compression_level = DEFLATE_MAX_LEVEL;
+        else if(strcmp(value, "adaptive") == 0)
+            options->compression_level = DEFLATE_LEVEL_ADAPTIVE;
+        else if(strcmp(value, "default") != 0)
+        {
+            options->compression_level = atoi(value);
+            if(options->compression_level < 0)
+                options->compression_level = 0;
+            else if(options->compression_level > DEFLATE_MAX_LEVEL)
+                options->compression_level = DEFLATE_MAX_LEVEL;
+        }
+    }
+
+    options->compression_budget = DEFLATE_DEFAULT_BUDGET;
+    if((value = get_option(map, "urf-compression-budget", "URFTOPDF_COMPRESSION_BUDGET")) != NULL)
+    {
+        options->compression_budget = strtoul(value, NULL, 10);
+        if(options->compression_budget == 0)
+            options->compression_budget = 1;
+    }
+
+    options->dedup = true;
+    if((value = get_option(map, "urf-dedup", "URFTOPDF_DEDUP")) != NULL)
+    {
+        options->dedup = !(strcmp(value, "false") == 0 || strcmp(value, "no") == 0 || strcmp(value, "0") == 0);
+    }
+
+    // Set by unirast_job_new()
+    options->output = OUTPUT_PDF;
+    options->rows = false;
+
+    options->pclm_strip_height = PCLM_STRIP_HEIGHT;
+    if((value = get_option(map, "urf-pclm-strip-height", "URFTOPDF_PCLM_STRIP_HEIGHT")) != NULL)
+    {
+        options->pclm_strip_height = strtoul(value, NULL, 10);
+        if(options->pclm_strip_height == 0)
+            options->pclm_strip_height = PCLM_STRIP_HEIGHT;
+    }
+
+    // Set by unirast_job_new(), argv[4] of the filter, collated as pstops does
+    options->copies = 1;
+    options->collate = false;
+    if((value = get_option(map, "Collate", NULL)) != NULL)
+        options->collate = (strcasecmp(value, "true") == 0 || strcasecmp(value, "yes") == 0 || strcasecmp(value, "on") == 0);
+    if((value = get_option(map, "multiple-document-handling", NULL)) != NULL)
+        options->collate = (strcmp(value, "separate-documents-collated-copies") == 0);
+
+    // CUPS gives every filter its RIP_MAX_CACHE
+    options->max_memory = 0;
+    if((value = get_option(map, "urf-max-memory", "URFTOPDF_MAX_MEMORY")) != NULL || (value = getenv("RIP_MAX_CACHE")) != NULL)
+    {
+        options->max_memory = parse_size(value);
+    }
+
+    options->stats = false;
+    if((value = get_option(map, "urf-stats", "URFTOPDF_STATS")) != NULL)
+    {
+        options->stats = (strcmp(value, "true") == 0 || strcmp(value, "yes") == 0 || strcmp(value, "1") == 0);
+    }
+}
+
+//------------- Statistics ---------------
+
+/*
+ * Opt-in job statistics (urf-stats), printed at the end of the job as one
+ * "INFO: urftopdf-stats {json}" line.  Stage times are summed over the
+ * calls, CPU time is that of the calling thread so it leaves out the
+ * waits on the pipeline queues.  Nothing is measured when disabled.
+ */
+enum stats_stage
+{
+    STAGE_HEADER,       // file and page headers, page setup
+    STAGE_SCAN,         // pre-scan of the page rasters
+    STAGE_DECODE,
+    STAGE_COMPRESS,     // summed over the workers in strip mode
+    STAGE_WRITE,        // PDF backend, final document output included
+    STAGE_COUNT
+};
+
+// PackBits codes and lines met while decoding the pages
+struct raster_counts
+{
+    uint64_t repeat_codes;
+    uint64_t literal_codes;
+    uint64_t fill_codes;        // -128, white up to the end of the line
+    uint64_t lines;             // URF lines
+    uint64_t repeated_lines;    // output lines coming from line repeats
+};
+
+struct urf_stats
+{
+    urf_stats()
+      : enabled(false),
+        pages(0),
+        blank_pages(0),
+        duplicate_pages(0),
+        raster_bytes(0),
+        image_bytes(0),
+        page_memory(0),
+        peak_page_memory(0)
+    {
+        unsigned i;
+
+        for(i = 0 ; i < STAGE_COUNT ; ++i)
+            wall_ns[i] = cpu_ns[i] = 0;
+        memset(&counts, 0, sizeof(counts));
+    }
+
+    bool enabled;
+    std::atomic<uint64_t> wall_ns[STAGE_COUNT];
+    std::atomic<uint64_t> cpu_ns[STAGE_COUNT];
+    std::atomic<uint64_t> pages;
+    std::atomic<uint64_t> blank_pages;
+    std::atomic<uint64_t> duplicate_pages;  // drawn from the images of an earlier page
+    std::atomic<uint64_t> raster_bytes;     // decoded image samples
+    std::atomic<uint64_t> image_bytes;      // compressed image data
+    std::atomic<int64_t> page_memory;       // bands and compressed data in flight
+    std::atomic<int64_t> peak_page_memory;
+    std::mutex counts_lock;                 // pages are decoded in parallel in page mode
+    struct raster_counts counts;
+};
+
+static struct urf_stats default_stats;
+static thread_local struct urf_stats * stats = &default_stats;
+
+struct stage_clock
+{
+    uint64_t wall;
+    uint64_t cpu;
+};
+
+static inline uint64_t clock_ns(clockid_t id)
+{
+    struct timespec ts;
+
+    clock_gettime(id, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static inline void stage_start(struct stage_clock * clock)
+{
+    if(!stats->enabled)
+    {
+        clock->wall = clock->cpu = 0;
+        return;
+    }
+    clock->wall = clock_ns(CLOCK_MONOTONIC);
+    clock->cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+}
+
+static inline void stage_stop(struct stage_clock * clock, int stage)
+{
+    if(!stats->enabled)
+        return;
+    stats->wall_ns[stage] += clock_ns(CLOCK_MONOTONIC) - clock->wall;
+    stats->cpu_ns[stage] += clock_ns(CLOCK_THREAD_CPUTIME_ID) - clock->cpu;
+}
+
+// Account bytes allocated (or freed if negative) for the pages in flight
+static inline void stats_memory(int64_t bytes)
+{
+    if(!stats->enabled)
+        return;
+
+    int64_t now = (stats->page_memory += bytes);
+    int64_t peak = stats->peak_page_memory;
+
+    while(now > peak && !stats->peak_page_memory.compare_exchange_weak(peak, now))
+        ;
+}
+
+static inline void stats_add_counts(const struct raster_counts * counts)
+{
+    if(!stats->enabled)
+        return;
+
+    std::lock_guard<std::mutex> guard(stats->counts_lock);
+    stats->counts.repeat_codes += counts->repeat_codes;
+    stats->counts.literal_codes += counts->literal_codes;
+    stats->counts.fill_codes += counts->fill_codes;
+    stats->counts.lines += counts->lines;
+    stats->counts.repeated_lines += counts->repeated_lines;
+}
+
+static inline double ratio(uint64_t a, uint64_t b)
+{
+    return b ? (double)a/b : 0;
+}
+
+void print_stats(unsigned long job, uint64_t bytes_in, uint64_t bytes_out)
+{
+    static const char * const stage_names[] = { "header", "scan", "decode", "compress", "write" };
+    struct rusage usage;
+    char * line = NULL;
+    size_t size;
+    FILE * out;
+    unsigned i;
+
+    if(!stats->enabled)
+        return;
+
+    getrusage(RUSAGE_SELF, &usage);
+    out = open_memstream(&line, &size);
+    if(out == NULL)
+        return;
+
+    fprintf(out, "{\"job\":%lu,\"pages\":%llu,\"blank_pages\":%llu,\"duplicate_pages\":%llu,\"time\":{", job,
+            (unsigned long long)stats->pages, (unsigned long long)stats->blank_pages, (unsigned long long)stats->duplicate_pages);
+    for(i = 0 ; i < STAGE_COUNT ; ++i)
+        fprintf(out, "%s\"%s\":{\"wall\":%.6f,\"cpu\":%.6f}", i ? "," : "", stage_names[i],
+                stats->wall_ns[i]/1e9, stats->cpu_ns[i]/1e9);
+    fprintf(out, "},\"bytes_in\":%llu,\"bytes_out\":%llu,\"raster_bytes\":%llu,\"image_bytes\":%llu,\"compression_ratio\":%.3f,"
+            "\"codes\":{\"repeat\":%llu,\"literal\":%llu,\"fill\":%llu},"
+            "\"lines\":%llu,\"repeated_lines\":%llu,\"line_repeat_rate\":%.4f,"
+            "\"peak_page_memory\":%lld,\"spilled_bytes\":%llu,\"peak_rss\":%lld}",
+            (unsigned long long)bytes_in, (unsigned long long)bytes_out,
+            (unsigned long long)stats->raster_bytes, (unsigned long long)stats->image_bytes,
+            ratio(stats->raster_bytes, stats->image_bytes),
+            (unsigned long long)stats->counts.repeat_codes, (unsigned long long)stats->counts.literal_codes,
+            (unsigned long long)stats->counts.fill_codes,
+            (unsigned long long)stats->counts.lines, (unsigned long long)stats->counts.repeated_lines,
+            ratio(stats->counts.repeated_lines, stats->counts.lines + stats->counts.repeated_lines),
+            (long long)stats->peak_page_memory, (unsigned long long)budget->spilled, (long long)usage.ru_maxrss*1024);
+    if(fclose(out) == 0)
+        job_log_line(UNIRAST_LOG_STATS, line);
+    free(line);
+}
+
+//------------- Job ---------------
+
+/*
+ * What a conversion does not share with the other jobs of the process:
+ * memory budget, statistics, deflate tuner and log.  The threads working
+ * for a job enter its state first, see job_enter().
+ */
+struct job_state
+{
+    job_state()
+      : log(NULL),
+        log_ctx(NULL)
+    {
+    }
+
+    struct memory_budget budget;
+    struct urf_stats stats;
+    struct deflate_tuner tuner;
+    void (*log)(void * ctx, int level, const char * message);  // NULL for none
+    void * log_ctx;
+    std::mutex log_lock;                // the threads of the job log one at a time
+};
+
+static thread_local struct job_state * current_job = NULL;
+
+// NULL leaves the job, back to the defaults
+void job_enter(struct job_state * state)
+{
+    current_job = state;
+    budget = state ? &state->budget : &default_budget;
+    stats = state ? &state->stats : &default_stats;
+    tuner = state ? &state->tuner : &default_tuner;
+}
+
+// As CUPS reads the stderr of filters
+static void log_stderr(void * ctx, int level, const char * message)
+{
+    static const char * const prefixes[] = { "DEBUG", "INFO", "CRIT" };
+
+    if(level == UNIRAST_LOG_STATS)
+        fprintf(stderr, "INFO: " PROGRAM "-stats %s\n", message);
+    else
+        fprintf(stderr, "%s: (" PROGRAM ") %s\n", prefixes[level], message);
+}
+
+void job_log_line(int level, const char * message)
+{
+    struct job_state * job = current_job;
+
+    if(job == NULL)
+    {
+        log_stderr(NULL, level, message);
+        return;
+    }
+    if(job->log == NULL)
+        return;
+
+    std::lock_guard<std::mutex> guard(job->log_lock);
+    job->log(job->log_ctx, level, message);
+}
+
+void job_log(int level, const char * format, ...)
+{
+    char message[1024];
+    va_list args;
+    size_t size;
+
+    if(current_job && current_job->log == NULL)
+        return;
+
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+
+    // Lines are given without their newline
+    size = strlen(message);
+    if(size > 0 && message[size - 1] == '\n')
+        message[size - 1] = 0;
+
+    job_log_line(level, message);
+}
+
+//------------- PDF ---------------
+
+// Horizontal slice of the page image, compressed on its own
+struct pdf_strip
+{
+    unsigned y;                         // first line, from the top
+    unsigned height;
+    image_buffer image_data;            // deflated samples
+    uint64_t compress_ns;               // time spent compressing it
+    std::future<void> done;             // valid while still being compressed
+};
+
+// A decoded and compressed page, handed to the PDF backend
+struct pdf_page
+{
+    unsigned number;
+    unsigned width;
+    unsigned height;
+    unsigned bpp;
+    unsigned dpi;
+    unsigned colorspace;
+    unsigned urf_width;                 // URF raster size, the MediaBox
+    unsigned urf_height;                // width and height are the image size
+    unsigned urf_components;            // samples in the URF pixels
+    unsigned components;
+    unsigned bits;                      // per component, 8, 16 or 1 for bilevel pages
+    unsigned line_bytes;
+    unsigned strip_lines;               // 0 for a single image
+    unsigned downsample;                // URF pixels per image pixel, both ways
+    unsigned urf_duplex;                // URF header modes, for PWG Raster pages
+    unsigned urf_quality;
+    bool blank;                         // no image at all
+    int same_as;                        // earlier page with the same raster, -1 if none
+    int encoding;                       // enum image_encoding
+    int predictor;                      // enum png_filter or PREDICTOR_OFF
+    int quality;                        // of ENCODING_DCT, deflate level otherwise
+    struct image_encoder * encoder;     // page mode, compresses the bands as they are decoded
+    std::deque<struct pdf_strip> strips;
+};
+
+// Blank pages and repeated pages have no image of their own to encode
+static inline bool page_has_raster(const struct pdf_page * page)
+{
+    return !page->blank && page->same_as < 0;
+}
+
+/*
+ * PCLm pages (urftopclm) draw their strips, named /Image0 to /ImageN from
+ * the top, in image pixels inside one marked content sequence.
+ */
+std::string pclm_content(struct pdf_page * page)
+{
+    double scale = (double)DEFAULT_PDF_UNIT/page->dpi;
+    std::string content;
+    char buffer[128];
+    unsigned n = 0;
+
+    // Downsampled images still cover the URF page
+    snprintf(buffer, sizeof(buffer), "/P <</MCID 0>> BDC q\n%.4f 0 0 %.4f 0 0 cm\n",
+             scale*page->urf_width/page->width, scale*page->urf_height/page->height);
+    content.append(buffer);
+    for(std::deque<struct pdf_strip>::iterator strip = page->strips.begin() ; strip != page->strips.end() ; ++strip, ++n)
+    {
+        snprintf(buffer, sizeof(buffer), "q %u 0 0 %u 0 %u cm /Image%u Do Q\n", page->width, strip->height,
+                 page->height - strip->y - strip->height, n);
+        content.append(buffer);
+    }
+    content.append("Q EMC\n");
+
+    return content;
+}
+
+#ifdef HPDF_BACKEND
+// Images drawn on a page, to draw them again on its copies
+struct hpdf_placement
+{
+    HPDF_Image image;
+    float y;
+    float height;
+};
+
+struct hpdf_page
+{
+    float width;
+    float height;
+    std::vector<struct hpdf_placement> images;
+};
+#endif
+
+/*
+ * Backends keep what they need to add copies of the pages they are given,
+ * see add_pdf_page_copy().
+ */
+struct pdf_info
+{
+#ifdef HPDF_BACKEND
+    pdf_info()
+      : pdf(NULL),
+        out(NULL),
+        error_no(HPDF_OK),
+        detail_no(0),
+        pagecount(0),
+        pclm(false)
+    {
+    }
+
+    // Still set when the job failed
+    ~pdf_info()
+    {
+        if(pdf)
+            HPDF_Free(pdf);
+    }
+
+    HPDF_Doc pdf;
+    FILE * out;
+    HPDF_STATUS error_no;               // first libharu error, see pdf_error_handler()
+    HPDF_STATUS detail_no;
+    std::map<unsigned, struct hpdf_page> drawn;         // by page number
+#endif
+#ifdef QPDF_BACKEND
+    pdf_info() 
+      : out(NULL),
+        pagecount(0),
+        pclm(false)
+    {
+    }
+
+    QPDF pdf;
+    FILE * out;
+    std::map<unsigned, QPDFObjectHandle> drawn;         // page objects by page number
+#endif
+#ifdef STREAM_BACKEND
+    pdf_info()
+      : out(NULL),
+        offset(0),
+        pagecount(0),
+        pclm(false)
+    {
+    }
+
+    FILE * out;
+    uint64_t offset;                    // bytes written so far
+    std::vector<uint64_t> objects;      // offset of each object, number - 1
+    std::vector<unsigned> pages;        // page object numbers
+    std::map<unsigned, std::string> drawn;              // page dictionary entries by page number
+#endif
+    unsigned pagecount;
+    bool pclm;                          // PCLm document, see pclm_content()
+};
+
+#ifdef HPDF_BACKEND
+// Called from the C frames of libharu: the error is only kept, the failed call is checked by pdf_check()
+void pdf_error_handler(HPDF_STATUS error_no, HPDF_STATUS detail_no, void *user_data)
+{
+    struct pdf_info * info = (struct pdf_info *)user_data;
+
+    if(info->error_no != HPDF_OK)
+        return;
+    info->error_no = error_no;
+    info->detail_no = detail_no;
+}
+
+void pdf_check(struct pdf_info * info, HPDF_STATUS ret, const char * what)
+{
+    char message[128];
+
+    if(ret == HPDF_OK && info->error_no == HPDF_OK)
+        return;
+
+    snprintf(message, sizeof(message), "%s, error_no=%04X, detail_no=%u", what, (HPDF_UINT)info->error_no, (HPDF_UINT)info->detail_no);
+    die(message);
+}
+
+int create_pdf_file(struct pdf_info * info, FILE * out, unsigned pagecount, bool pclm)
+{
+    // libharu writes the file header itself
+    if(pclm) die("PCLm output needs the qpdf or stream backend");
+    if((info->pdf = HPDF_New (pdf_error_handler, info)) == NULL) die("cannot create PdfDoc object");
+    info->out = out;
+
+    pdf_check(info, HPDF_SetCompressionMode(info->pdf, HPDF_COMP_ALL), "Unable to set the compression mode");
+
+    info->pagecount = pagecount;
+
+    return 0;
+}
+
+/*
+ * HPDF_LoadRawImageFromMem() wants the whole raw page, so build the image
+ * XObject by hand and give it the already deflated data.  The stream filter
+ * is left to NONE so libharu writes the data as is.
+ */
+HPDF_Image create_image(struct pdf_info * info, struct pdf_page * page, struct pdf_strip * strip)
+{
+    HPDF_Image image = HPDF_DictStream_New(info->pdf->mmgr, info->pdf->xref);
+    HPDF_STATUS ret = HPDF_OK;
+
+    if(image == NULL) return NULL;
+
+    image->header.obj_class |= HPDF_OSUBCLASS_XOBJECT;
+    image->filter = HPDF_STREAM_FILTER_NONE;
+
+    ret += HPDF_Dict_AddName(image, "Type", "XObject");
+    ret += HPDF_Dict_AddName(image, "Subtype", "Image");
+    ret += HPDF_Dict_AddNumber(image, "Width", page->width);
+    ret += HPDF_Dict_AddNumber(image, "Height", strip->height);
+    ret += HPDF_Dict_AddNumber(image, "BitsPerComponent", page->bits);
+    if(page->components == 1)
+        ret += HPDF_Dict_AddName(image, "ColorSpace", "DeviceGray");
+    else if(page->components == 4)
+        ret += HPDF_Dict_AddName(image, "ColorSpace", "DeviceCMYK");
+    else
+        ret += HPDF_Dict_AddName(image, "ColorSpace", "DeviceRGB");
+    if(page->encoding == ENCODING_FLATE)
+        ret += HPDF_Dict_AddName(image, "Filter", "FlateDecode");
+    else if(page->encoding == ENCODING_RLE)
+        ret += HPDF_Dict_AddName(image, "Filter", "RunLengthDecode");
+    else if(page->encoding == ENCODING_DCT)
+        ret += HPDF_Dict_AddName(image, "Filter", "DCTDecode");
+    else if(page->encoding == ENCODING_CCITT)
+    {
+        HPDF_Dict parms = HPDF_Dict_New(info->pdf->mmgr);
+        if(parms == NULL) return NULL;
+
+        ret += HPDF_Dict_AddName(image, "Filter", "CCITTFaxDecode");
+        ret += HPDF_Dict_AddNumber(parms, "K", -1);
+        ret += HPDF_Dict_AddNumber(parms, "Columns", page->width);
+        ret += HPDF_Dict_AddNumber(parms, "Rows", strip->height);
+        ret += HPDF_Dict_Add(image, "DecodeParms", parms);
+    }
+    else
+    {
+        HPDF_Array filters = HPDF_Array_New(info->pdf->mmgr);
+        if(filters == NULL) return NULL;
+
+        ret += HPDF_Array_AddName(filters, "FlateDecode");
+        ret += HPDF_Array_AddName(filters, "RunLengthDecode");
+        ret += HPDF_Dict_Add(image, "Filter", filters);
+    }
+
+    if(page->predictor != PREDICTOR_OFF)
+    {
+        HPDF_Dict parms = HPDF_Dict_New(info->pdf->mmgr);
+        if(parms == NULL) return NULL;
+
+        ret += HPDF_Dict_AddNumber(parms, "Predictor", pdf_predictor(page->predictor));
+        ret += HPDF_Dict_AddNumber(parms, "Colors", page->components);
+        ret += HPDF_Dict_AddNumber(parms, "BitsPerComponent", page->bits);
+        ret += HPDF_Dict_AddNumber(parms, "Columns", page->width);
+        ret += HPDF_Dict_Add(image, "DecodeParms", parms);
+    }
+
+    ret += HPDF_Stream_Write(image->stream, &strip->image_data[0], strip->image_data.size());
+
+    if(ret != HPDF_OK) return NULL;
+
+    return image;
+}
+
+int add_pdf_page(struct pdf_info * info, struct pdf_page * page)
+{
+    HPDF_Page pdf_page = HPDF_AddPage(info->pdf);
+    float scale = (float)DEFAULT_PDF_UNIT/(float)page->dpi;
+    float page_width = page->urf_width*scale;
+    float line_height = page->urf_height*scale/page->height;   // of the image
+
+    struct hpdf_page * drawn;
+
+    try {
+        drawn = &info->drawn[page->number];
+    } catch (...) {
+        die("Unable to allocate page data");
+    }
+
+    // Convert to 72DPI sizes
+    drawn->width = page_width;
+    drawn->height = page->urf_height*scale;
+    pdf_check(info, (pdf_page == NULL) ? HPDF_FAILD_TO_ALLOC_MEM : HPDF_OK, "Unable to add a page");
+    pdf_check(info, HPDF_Page_SetWidth(pdf_page, drawn->width), "Unable to set the page size");
+    pdf_check(info, HPDF_Page_SetHeight(pdf_page, drawn->height), "Unable to set the page size");
+
+    for(std::deque<struct pdf_strip>::iterator strip = page->strips.begin() ; strip != page->strips.end() ; ++strip)
+    {
+        struct hpdf_placement placement;
+
+        placement.image = create_image(info, page, &*strip);
+        pdf_check(info, (placement.image == NULL) ? HPDF_FAILD_TO_ALLOC_MEM : HPDF_OK, "Unable to load image data");
+        placement.y = (page->height - strip->y - strip->height)*line_height;
+        placement.height = strip->height*line_height;
+
+        pdf_check(info, HPDF_Page_DrawImage(pdf_page, placement.image, 0, placement.y, page_width, placement.height),
+                  "Unable to draw image");
+        try {
+            drawn->images.push_back(placement);
+        } catch (...) {
+            die("Unable to allocate page data");
+        }
+    }
+
+    return 0;
+}
+
+// Another page drawing the images of page number, which was added before
+int add_pdf_page_copy(struct pdf_info * info, unsigned number)
+{
+    std::map<unsigned, struct hpdf_page>::iterator drawn = info->drawn.find(number);
+    HPDF_Page pdf_page;
+    unsigned i;
+
+    if(drawn == info->drawn.end())
+        return 1;
+
+    pdf_page = HPDF_AddPage(info->pdf);
+    pdf_check(info, (pdf_page == NULL) ? HPDF_FAILD_TO_ALLOC_MEM : HPDF_OK, "Unable to add a page");
+    pdf_check(info, HPDF_Page_SetWidth(pdf_page, drawn->second.width), "Unable to set the page size");
+    pdf_check(info, HPDF_Page_SetHeight(pdf_page, drawn->second.height), "Unable to set the page size");
+    for(i = 0 ; i < drawn->second.images.size() ; ++i)
+    {
+        struct hpdf_placement * placement = &drawn->second.images[i];
+
+        pdf_check(info, HPDF_Page_DrawImage(pdf_page, placement->image, 0, placement->y, drawn->second.width, placement->height),
+                  "Unable to draw image");
+    }
+
+    return 0;
+}
+
+static HPDF_STATUS pdf_output_write(HPDF_Stream stream, const HPDF_BYTE * data, HPDF_UINT size)
+{
+    struct pdf_info * info = (struct pdf_info *)stream->attr;
+
+    if(size > 0 && fwrite(data, size, 1, info->out) != 1)
+        return HPDF_SetError(stream->error, HPDF_FILE_IO_ERROR, 0);
+
+    return HPDF_OK;
+}
+
+/*
+ * HPDF_SaveToStream() serializes into the document stream, a memory stream
+ * holding the whole file unless one is already set: give it one writing
+ * straight to info->out.
+ */
+int close_pdf_file(struct pdf_info * info)
+{
+    info->pdf->stream = HPDF_CallbackWriter_New(info->pdf->mmgr, pdf_output_write, info);
+    if(info->pdf->stream == NULL) return 1;
+
+    if(HPDF_SaveToStream(info->pdf) != HPDF_OK) return 1;
+
+    HPDF_Free(info->pdf);
+    info->pdf = NULL;
+
+    return 0;
+}
+#endif
+#ifdef QPDF_BACKEND
+int create_pdf_file(struct pdf_info * info, FILE * out, unsigned pagecount, bool pclm)
+{
+    try {
+        info->pdf.emptyPDF();
+    } catch (...) {
+        return 1;
+    }
+
+    info->out = out;
+    info->pagecount = pagecount;
+    info->pclm = pclm;
+
+    return 0;
+}
+
+QPDFObjectHandle makeBox(double x1, double y1, double x2, double y2)
+{
+    QPDFObjectHandle ret=QPDFObjectHandle::newArray();
+    ret.appendItem(QPDFObjectHandle::newReal(x1));
+    ret.appendItem(QPDFObjectHandle::newReal(y1));
+    ret.appendItem(QPDFObjectHandle::newReal(x2));
+    ret.appendItem(QPDFObjectHandle::newReal(y2));
+    return ret;
+}
+
+enum ColorSpace {
+    DEVICE_GRAY,
+    DEVICE_RGB,
+    DEVICE_CMYK
+};
+
+QPDFObjectHandle makeDecodeParms(struct pdf_page * page, struct pdf_strip * strip)
+{
+    std::map<std::string,QPDFObjectHandle> dict;
+
+    if(page->encoding == ENCODING_CCITT)
+    {
+        dict["/K"]=QPDFObjectHandle::newInteger(-1);
+        dict["/Columns"]=QPDFObjectHandle::newInteger(page->width);
+        dict["/Rows"]=QPDFObjectHandle::newInteger(strip->height);
+
+        return QPDFObjectHandle::newDictionary(dict);
+    }
+
+    if(page->predictor == PREDICTOR_OFF)
+        return QPDFObjectHandle::newNull();
+
+    dict["/Predictor"]=QPDFObjectHandle::newInteger(pdf_predictor(page->predictor));
+    dict["/Colors"]=QPDFObjectHandle::newInteger(page->components);
+    dict["/BitsPerComponent"]=QPDFObjectHandle::newInteger(page->bits);
+    dict["/Columns"]=QPDFObjectHandle::newInteger(page->width);
+
+    return QPDFObjectHandle::newDictionary(dict);
+}
+
+QPDFObjectHandle makeFilter(struct pdf_page * page)
+{
+    if(page->encoding == ENCODING_FLATE)
+        return QPDFObjectHandle::newName("/FlateDecode");
+    if(page->encoding == ENCODING_RLE)
+        return QPDFObjectHandle::newName("/RunLengthDecode");
+    if(page->encoding == ENCODING_CCITT)
+        return QPDFObjectHandle::newName("/CCITTFaxDecode");
+    if(page->encoding == ENCODING_DCT)
+        return QPDFObjectHandle::newName("/DCTDecode");
+
+    std::vector<QPDFObjectHandle> filters;
+    filters.push_back(QPDFObjectHandle::newName("/FlateDecode"));
+    filters.push_back(QPDFObjectHandle::newName("/RunLengthDecode"));
+
+    return QPDFObjectHandle::newArray(filters);
+}
+
+// page_data is already encoded, see compress_stage()
+QPDFObjectHandle makeImage(QPDF &pdf, PointerHolder<Buffer> page_data, unsigned width, unsigned height, ColorSpace cs, unsigned bpc,
+                           QPDFObjectHandle filter, QPDFObjectHandle decode_parms)
+{
+    QPDFObjectHandle ret = QPDFObjectHandle::newStream(&pdf);
+
+    std::map<std::string,QPDFObjectHandle> dict;
+
+    dict["/Type"]=QPDFObjectHandle::newName("/XObject");
+    dict["/Subtype"]=QPDFObjectHandle::newName("/Image");
+    dict["/Width"]=QPDFObjectHandle::newInteger(width);
+    dict["/Height"]=QPDFObjectHandle::newInteger(height);
+    dict["/BitsPerComponent"]=QPDFObjectHandle::newInteger(bpc);
+
+    if (cs==DEVICE_GRAY) {
+        dict["/ColorSpace"]=QPDFObjectHandle::newName("/DeviceGray");
+    } else if (cs==DEVICE_RGB) {
+        dict["/ColorSpace"]=QPDFObjectHandle::newName("/DeviceRGB");
+    } else if (cs==DEVICE_CMYK) {
+        dict["/ColorSpace"]=QPDFObjectHandle::newName("/DeviceCMYK");
+    } else {
+        return QPDFObjectHandle();
+    }
+
+    ret.replaceDict(QPDFObjectHandle::newDictionary(dict));
+
+    ret.replaceStreamData(page_data, filter, decode_parms);
+
+    return ret;
+}
+
+int add_pdf_page(struct pdf_info * info, struct pdf_page * page)
+{
+    try {
+        ColorSpace qpdf_cs = DEVICE_RGB;
+        if(page->components == 1)
+          qpdf_cs = DEVICE_GRAY;
+        else if(page->components == 4)
+          qpdf_cs = DEVICE_CMYK;
+
+        QPDFObjectHandle pdf_page = QPDFObjectHandle::parse(
+            "<<"
+            "  /Type /Page"
+            "  /Resources <<"
+            "    /XObject << >> "
+            "  >>"
+            "  /MediaBox null "
+            "  /Contents null "
+            ">>");
+
+        // Convert to pdf units
+        double scale=(double)DEFAULT_PDF_UNIT/page->dpi;
+        double page_width=page->urf_width*scale;
+        double page_height=page->urf_height*scale;
+        double line_height=page_height/page->height;
+        pdf_page.replaceKey("/MediaBox",makeBox(0,0,page_width,page_height));
+
+        std::string content;
+        unsigned n = 0;
+        for(std::deque<struct pdf_strip>::iterator strip = page->strips.begin() ; strip != page->strips.end() ; ++strip, ++n)
+        {
+            PointerHolder<Buffer> page_data(new Buffer(strip->image_data.size()));
+            memcpy(page_data->getBuffer(), &strip->image_data[0], strip->image_data.size());
+
+            QPDFObjectHandle image = makeImage(info->pdf, page_data, page->width, strip->height, qpdf_cs, page->bits,
+                                               makeFilter(page), makeDecodeParms(page, &*strip));
+            if(!image.isInitialized()) die("Unable to load image data");
+
+            // add it
+            std::string name = (info->pclm ? "/Image" : "/I") + QUtil::int_to_string(n);
+            pdf_page.getKey("/Resources").getKey("/XObject").replaceKey(name,image);
+
+            // draw it
+            content.append("q " + QUtil::double_to_string(page_width) + " 0 0 " +
+                           QUtil::double_to_string(strip->height*line_height) + " 0 " +
+                           QUtil::double_to_string((page->height - strip->y - strip->height)*line_height) + " cm\n");
+            content.append(name + " Do Q\n");
+        }
+        if(info->pclm)
+            content = pclm_content(page);
+        QPDFObjectHandle contents = QPDFObjectHandle::newStream(&info->pdf);
+        contents.replaceStreamData(content,QPDFObjectHandle::newNull(),QPDFObjectHandle::newNull());
+        pdf_page.replaceKey("/Contents",contents);
+
+        pdf_page = info->pdf.makeIndirectObject(pdf_page);
+        info->drawn[page->number] = pdf_page;
+        info->pdf.addPage(pdf_page, false);
+    } catch (std::bad_alloc &ex) {
+        die("Unable to allocate page data");
+    } catch (...) {
+        return 1;
+    }
+
+    return 0;
+}
+
+// Another page sharing the resources and contents of page number, which was added before
+int add_pdf_page_copy(struct pdf_info * info, unsigned number)
+{
+    std::map<unsigned, QPDFObjectHandle>::iterator drawn = info->drawn.find(number);
+
+    if(drawn == info->drawn.end())
+        return 1;
+
+    try {
+        QPDFObjectHandle pdf_page = QPDFObjectHandle::parse("<< /Type /Page >>");
+
+        pdf_page.replaceKey("/MediaBox", drawn->second.getKey("/MediaBox"));
+        pdf_page.replaceKey("/Resources", drawn->second.getKey("/Resources"));
+        pdf_page.replaceKey("/Contents", drawn->second.getKey("/Contents"));
+
+        info->pdf.addPage(info->pdf.makeIndirectObject(pdf_page), false);
+    } catch (std::bad_alloc &ex) {
+        die("Unable to allocate page data");
+    } catch (...) {
+        return 1;
+    }
+
+    return 0;
+}
+
+int close_pdf_file(struct pdf_info * info)
+{
+    try {
+        QPDFWriter output(info->pdf);
+        output.setOutputFile("output", info->out, false);
+        if(info->pclm)
+        {
+            output.setMinimumPDFVersion("1.7");
+            output.setExtraHeaderText("%PCLm 1.0");
+        }
+        output.write();
+    } catch (...) {
+        return 1;
+    }
+
+    return 0;
+}
+#endif
+#ifdef STREAM_BACKEND
+/*
+ * Minimal PDF writer: the objects of each page go out as soon as the page
+ * is added, only their offsets are kept for the xref table written by
+ * close_pdf_file() along with the page tree.
+ */
+#define STREAM_CATALOG 1
+#define STREAM_PAGES 2
+
+static int pdf_write(struct pdf_info * info, const void * data, size_t size)
+{
+    if(size && fwrite(data, size, 1, info->out) != 1)
+        return 1;
+    info->offset += size;
+
+    return 0;
+}
+
+static int pdf_printf(struct pdf_info * info, const char * format, ...) __attribute__((format(printf, 2, 3)));
+
+static int pdf_printf(struct pdf_info * info, const char * format, ...)
+{
+    va_list args;
+    int size;
+
+    va_start(args, format);
+    size = vfprintf(info->out, format, args);
+    va_end(args);
+    if(size < 0)
+        return 1;
+    info->offset += size;
+
+    return 0;
+}
+
+// Number the next object and record where it starts
+static unsigned pdf_begin_object(struct pdf_info * info, unsigned number)
+{
+    if(number == 0)
+        number = info->objects.size() + 1;
+    if(info->objects.size() < number)
+        info->objects.resize(number, 0);
+    info->objects[number - 1] = info->offset;
+
+    pdf_printf(info, "%u 0 obj\n", number);
+
+    return number;
+}
+
+int create_pdf_file(struct pdf_info * info, FILE * out, unsigned pagecount, bool pclm)
+{
+    info->out = out;
+    info->pagecount = pagecount;
+    info->pclm = pclm;
+
+    try {
+        info->objects.resize(STREAM_PAGES, 0);
+    } catch (...) {
+        return 1;
+    }
+
+    // The binary comment marks the file as binary for transfer tools
+    if(pclm)
+    {
+        if(pdf_printf(info, "%%PDF-1.7\n%%PCLm 1.0\n%%\xE2\xE3\xCF\xD3\n") != 0) return 1;
+    }
+    else if(pdf_printf(info, "%%PDF-1.4\n%%\xE2\xE3\xCF\xD3\n") != 0)
+        return 1;
+
+    pdf_begin_object(info, STREAM_CATALOG);
+    return pdf_printf(info, "<< /Type /Catalog /Pages %u 0 R >>\nendobj\n", STREAM_PAGES);
+}
+
+static int write_image(struct pdf_info * info, struct pdf_page * page, struct pdf_strip * strip, unsigned number)
+{
+    int ret = 0;
+
+    pdf_begin_object(info, number);
+    ret += pdf_printf(info, "<< /Type /XObject /Subtype /Image /Width %u /Height %u /BitsPerComponent %u /ColorSpace /%s",
+                      page->width, strip->height, page->bits,
+                      (page->components == 1) ? "DeviceGray" : ((page->components == 4) ? "DeviceCMYK" : "DeviceRGB"));
+
+    if(page->encoding == ENCODING_FLATE)
+        ret += pdf_printf(info, " /Filter /FlateDecode");
+    else if(page->encoding == ENCODING_RLE)
+        ret += pdf_printf(info, " /Filter /RunLengthDecode");
+    else if(page->encoding == ENCODING_DCT)
+        ret += pdf_printf(info, " /Filter /DCTDecode");
+    else if(page->encoding == ENCODING_CCITT)
+        ret += pdf_printf(info, " /Filter /CCITTFaxDecode /DecodeParms << /K -1 /Columns %u /Rows %u >>",
+                          page->width, strip->height);
+    else
+        ret += pdf_printf(info, " /Filter [ /FlateDecode /RunLengthDecode ]");
+
+    if(page->predictor != PREDICTOR_OFF)
+        ret += pdf_printf(info, " /DecodeParms << /Predictor %d /Colors %u /BitsPerComponent %u /Columns %u >>",
+                          pdf_predictor(page->predictor), page->components, page->bits, page->width);
+
+    ret += pdf_printf(info, " /Length %lu >>\nstream\n", (unsigned long)strip->image_data.size());
+    ret += pdf_write(info, &strip->image_data[0], strip->image_data.size());
+    ret += pdf_printf(info, "\nendstream\nendobj\n");
+
+    return ret;
+}
+
+int add_pdf_page(struct pdf_info * info, struct pdf_page * page)
+{
+    double scale = (double)DEFAULT_PDF_UNIT/page->dpi;
+    double page_width = page->urf_width*scale;
+    double page_height = page->urf_height*scale;
+    double line_height = page_height/page->height;
+    unsigned first_image = info->objects.size() + 1;
+    unsigned contents = first_image + page->strips.size();
+    unsigned n;
+    std::string content, resources;
+    char buffer[256];
+    int ret = 0;
+
+    try {
+        n = 0;
+        for(std::deque<struct pdf_strip>::iterator strip = page->strips.begin() ; strip != page->strips.end() ; ++strip, ++n)
+        {
+            ret += write_image(info, page, &*strip, first_image + n);
+
+            snprintf(buffer, sizeof(buffer), "q %.4f 0 0 %.4f 0 %.4f cm /I%u Do Q\n", page_width,
+                     strip->height*line_height, (page->height - strip->y - strip->height)*line_height, n);
+            content.append(buffer);
+            snprintf(buffer, sizeof(buffer), " /%s%u %u 0 R", info->pclm ? "Image" : "I", n, first_image + n);
+            resources.append(buffer);
+        }
+        if(info->pclm)
+            content = pclm_content(page);
+
+        pdf_begin_object(info, contents);
+        ret += pdf_printf(info, "<< /Length %lu >>\nstream\n", (unsigned long)content.size());
+        ret += pdf_write(info, content.data(), content.size());
+        ret += pdf_printf(info, "endstream\nendobj\n");
+
+        std::string & drawn = info->drawn[page->number];
+        snprintf(buffer, sizeof(buffer), "/MediaBox [ 0 0 %.4f %.4f ] /Resources << /XObject <<", page_width, page_height);
+        drawn = buffer;
+        drawn.append(resources);
+        snprintf(buffer, sizeof(buffer), " >> >> /Contents %u 0 R", contents);
+        drawn.append(buffer);
+
+        info->pages.push_back(pdf_begin_object(info, 0));
+        ret += pdf_printf(info, "<< /Type /Page /Parent %u 0 R %s >>\nendobj\n", STREAM_PAGES, drawn.c_str());
+    } catch (...) {
+        die("Unable to allocate page data");
+    }
+
+    // Downstream filters get each page as soon as it is done
+    if(fflush(info->out) != 0)
+        return 1;
+
+    return ret ? 1 : 0;
+}
+
+// Another page object pointing to the images and contents of page number
+int add_pdf_page_copy(struct pdf_info * info, unsigned number)
+{
+    std::map<unsigned, std::string>::iterator drawn = info->drawn.find(number);
+
+    if(drawn == info->drawn.end())
+        return 1;
+
+    try {
+        info->pages.push_back(pdf_begin_object(info, 0));
+    } catch (...) {
+        die("Unable to allocate page data");
+    }
+
+    return pdf_printf(info, "<< /Type /Page /Parent %u 0 R %s >>\nendobj\n", STREAM_PAGES, drawn->second.c_str());
+}
+
+int close_pdf_file(struct pdf_info * info)
+{
+    uint64_t xref;
+    unsigned i;
+    int ret = 0;
+
+    pdf_begin_object(info, STREAM_PAGES);
+    ret += pdf_printf(info, "<< /Type /Pages /Count %lu /Kids [", (unsigned long)info->pages.size());
+    for(i = 0 ; i < info->pages.size() ; ++i)
+        ret += pdf_printf(info, " %u 0 R", info->pages[i]);
+    ret += pdf_printf(info, " ] >>\nendobj\n");
+
+    xref = info->offset;
+    ret += pdf_printf(info, "xref\n0 %lu\n0000000000 65535 f \n", (unsigned long)info->objects.size() + 1);
+    for(i = 0 ; i < info->objects.size() ; ++i)
+        ret += pdf_printf(info, "%010llu 00000 n \n", (unsigned long long)info->objects[i]);
+    ret += pdf_printf(info, "trailer\n<< /Size %lu /Root %u 0 R >>\nstartxref\n%llu\n%%%%EOF\n",
+                      (unsigned long)info->objects.size() + 1, STREAM_CATALOG, (unsigned long long)xref);
+
+    if(fflush(info->out) != 0)
+        return 1;
+
+    return ret ? 1 : 0;
+}
+#endif
+
+//------------- PWG Raster ---------------
+
+/*
+ * PWG Raster (PWG 5102.4) output, when run as urftopwg: the "RaS2" sync
+ * word, then for each page its 1796 bytes header and its lines.  PWG
+ * lines use the PackBits scheme of URF, the pages come as ENCODING_PWG
+ * strips which only have to be written in order.
+ */
+#define PWG_HEADER_SIZE 1796
+
+enum pwg_color_space
+{
+    PWG_CSPACE_RGB = 1,
+    PWG_CSPACE_CMYK = 6,
+    PWG_CSPACE_SGRAY = 18,
+    PWG_CSPACE_SRGB = 19,
+    PWG_CSPACE_ADOBERGB = 20
+};
+
+// Pages with copies to come are kept, all of them when collating
+struct pwg_info
+{
+    FILE * out;
+    unsigned pagecount;
+    unsigned copies;
+    bool collate;
+    std::map<unsigned, image_buffer> drawn;
+};
+
+static int pwg_write(struct pwg_info * info, const void * data, size_t size)
+{
+    if(size && fwrite(data, size, 1, info->out) != 1)
+        return 1;
+
+    return 0;
+}
+
+// Header fields are 32-bit big endian
+static inline void pwg_put(uint8_t * header, unsigned offset, uint32_t value)
+{
+    value = htonl(value);
+    memcpy(header + offset, &value, 4);
+}
+
+// URF color spaces as CUPS reads them from Apple raster
+static unsigned pwg_color_space(const struct pdf_page * page)
+{
+    if(page->components == 1)
+        return PWG_CSPACE_SGRAY;
+    if(page->components == 4)
+        return PWG_CSPACE_CMYK;
+    if(page->colorspace == UNIRAST_COLOR_SPACE_SRGB_24BIT_3)
+        return PWG_CSPACE_ADOBERGB;
+    if(page->colorspace == UNIRAST_COLOR_SPACE_SRGB_24BIT_5)
+        return PWG_CSPACE_RGB;
+
+    return PWG_CSPACE_SRGB;
+}
+
+int create_pwg_file(struct pwg_info * info, FILE * out, unsigned pagecount, struct urf_options * options)
+{
+    info->out = out;
+    info->pagecount = pagecount;
+    info->copies = options->copies;
+    info->collate = options->collate;
+
+    return pwg_write(info, "RaS2", 4);
+}
+
+// The header of the page, followed by its lines when blank
+static void pwg_page_header(struct pwg_info * info, struct pdf_page * page, image_buffer & data)
+{
+    uint8_t * header;
+    unsigned y;
+
+    data.assign(PWG_HEADER_SIZE, 0);
+    header = &data[0];
+
+    strcpy((char *)header, "PwgRaster");
+    // Duplex modes 2 and 3 are short and long edge
+    pwg_put(header, 272, page->urf_duplex >= 2);
+    pwg_put(header, 276, page->dpi);
+    pwg_put(header, 280, page->dpi);
+    pwg_put(header, 340, 1);
+    pwg_put(header, 352, ((uint64_t)page->urf_width*DEFAULT_PDF_UNIT + page->dpi/2)/page->dpi);
+    pwg_put(header, 356, ((uint64_t)page->urf_height*DEFAULT_PDF_UNIT + page->dpi/2)/page->dpi);
+    pwg_put(header, 368, page->urf_duplex == 2);
+    pwg_put(header, 372, page->width);
+    pwg_put(header, 376, page->height);
+    pwg_put(header, 384, page->bits);
+    pwg_put(header, 388, page->components*page->bits);
+    pwg_put(header, 392, page->line_bytes);
+    pwg_put(header, 400, pwg_color_space(page));
+    pwg_put(header, 420, page->components);
+    pwg_put(header, 452, info->pagecount);
+    pwg_put(header, 456, 1);
+    pwg_put(header, 460, 1);
+    pwg_put(header, 472, page->width);
+    pwg_put(header, 476, page->height);
+    if(page->urf_quality >= UNIRAST_QUALITY_3 && page->urf_quality <= UNIRAST_QUALITY_5)
+        pwg_put(header, 484, page->urf_quality);
+
+    // Blank pages have no strips, fill their lines with white
+    for(y = 0 ; page->blank && y < page->height ; y += 256)
+    {
+        data.push_back(((page->height - y > 256) ? 256 : page->height - y) - 1);
+        data.push_back(RLE_EOD);
+    }
+}
+
+int add_pwg_page(struct pwg_info * info, struct pdf_page * page)
+{
+    image_buffer data;
+    std::deque<struct pdf_strip>::iterator strip;
+    int ret = 0;
+
+    try {
+        pwg_page_header(info, page, data);
+        if(info->copies > 1)
+        {
+            for(strip = page->strips.begin() ; strip != page->strips.end() ; ++strip)
+                data.insert(data.end(), strip->image_data.begin(), strip->image_data.end());
+        }
+    } catch (...) {
+        die("Unable to allocate page data");
+    }
+
+    ret += pwg_write(info, &data[0], data.size());
+    if(info->copies == 1)
+    {
+        for(strip = page->strips.begin() ; strip != page->strips.end() ; ++strip)
+            ret += pwg_write(info, &strip->image_data[0], strip->image_data.size());
+        return ret ? 1 : 0;
+    }
+
+    // The copies of the other pages are already out when not collating
+    if(!info->collate)
+        info->drawn.clear();
+    try {
+        info->drawn[page->number].swap(data);
+    } catch (...) {
+        die("Unable to allocate page data");
+    }
+
+    return ret ? 1 : 0;
+}
+
+int add_pwg_page_copy(struct pwg_info * info, unsigned number)
+{
+    std::map<unsigned, image_buffer>::iterator drawn = info->drawn.find(number);
+
+    if(drawn == info->drawn.end())
+        return 1;
+
+    return pwg_write(info, &drawn->second[0], drawn->second.size());
+}
+
+int close_pwg_file(struct pwg_info * info)
+{
+    return (fflush(info->out) != 0) ? 1 : 0;
+}
+
+//------------- Pipeline ---------------
+
+/*
+ * Pages go through three stages, each on its own thread:
+ *   decode (job thread) -> compress_stage() -> write_stage()
+ * Decoded lines travel in bands and finished pages one by one, both
+ * queues are bounded so a fast stage waits for the slower ones.
+ * With more than one thread, pages are cut in strips which are deflated
+ * concurrently on a worker_pool and drawn as separate images.
+ *
+ * Page mode, for mapped inputs with more than one thread and page: the
+ * job thread only indexes the pages, each of them is then read, decoded
+ * and compressed by one worker, and the pages are handed in order to
+ * write_stage().
+ */
+
+#define BAND_BYTES (256*1024)
+#define PIPELINE_BANDS 8
+#define PIPELINE_PAGES 2
+#define STRIPS_PER_THREAD 2
+#define MIN_STRIP_LINES 32
+
+// Blocking FIFO holding at most capacity items
+template<class T>
+class bounded_queue
+{
+public:
+    bounded_queue(size_t capacity)
+      : capacity(capacity)
+    {
+    }
+
+    void push(T item)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        not_full.wait(guard, [this] { return items.size() < capacity; });
+        items.push_back(item);
+        not_empty.notify_one();
+    }
+
+    T pop()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        not_empty.wait(guard, [this] { return !items.empty(); });
+        T item = items.front();
+        items.pop_front();
+        not_full.notify_one();
+        return item;
+    }
+
+private:
+    std::mutex lock;
+    std::condition_variable not_full;
+    std::condition_variable not_empty;
+    std::deque<T> items;
+    size_t capacity;
+};
+
+// Fixed set of threads running submitted jobs in order
+class worker_pool
+{
+public:
+    worker_pool(unsigned threads, struct job_state * state)
+      : jobs(threads*2)
+    {
+        unsigned i;
+
+        for(i = 0 ; i < threads ; ++i)
+            workers.push_back(std::thread(&worker_pool::run, this, state));
+    }
+
+    ~worker_pool()
+    {
+        unsigned i;
+
+        for(i = 0 ; i < workers.size() ; ++i)
+            jobs.push(NULL);
+        for(i = 0 ; i < workers.size() ; ++i)
+            workers[i].join();
+    }
+
+    // Blocks while all workers are busy and the backlog is full
+    std::future<void> submit(std::function<void()> job)
+    {
+        std::packaged_task<void()> * task = new std::packaged_task<void()>(job);
+        std::future<void> done = task->get_future();
+
+        jobs.push(task);
+
+        return done;
+    }
+
+private:
+    void run(struct job_state * state)
+    {
+        std::packaged_task<void()> * task;
+
+        job_enter(state);
+        while((task = jobs.pop()) != NULL)
+        {
+            (*task)();
+            delete task;
+        }
+    }
+
+    bounded_queue<std::packaged_task<void()> *> jobs;
+    std::vector<std::thread> workers;
+};
+
+void pool_free(uint8_t * buffer, size_t size);
+
+// Consecutive decoded lines of a page, line i is to be output repeats[i] times
+struct raster_band
+{
+    struct pdf_page * page;   // NULL marks the end of the job
+    bool last;                // last band of the page
+    unsigned first_line;
+    unsigned height;          // output lines, repeats included
+    unsigned max_height;      // strip height, 0 if unbounded
+    unsigned lines;
+    unsigned capacity;
+    size_t slot_bytes;        // room for one line in data
+    uint8_t * data;           // from pool_alloc(), kept when the band is recycled
+    size_t data_size;
+    std::vector<unsigned> repeats;
+    std::vector<unsigned> sizes;
+
+    raster_band()
+      : data(NULL),
+        data_size(0)
+    {
+    }
+
+    ~raster_band()
+    {
+        stats_memory(-(int64_t)data_size);
+        pool_free(data, data_size);
+    }
+};
+
+/*
+ * Bands, image encoders and compressed image buffers are recycled from
+ * page to page instead of being allocated for each of them, so their
+ * memory is only faulted in once for the job.  Band buffers grow to the
+ * largest band seen, those spanning huge pages are aligned on them.
+ */
+#define HUGE_PAGE_SIZE (2*1024*1024)
+
+struct buffer_pool
+{
+    std::mutex lock;
+    std::vector<struct raster_band *> bands;
+    std::vector<struct image_encoder *> encoders;
+    std::deque<image_buffer> image_data;            // emptied, capacity kept
+};
+
+static inline size_t pool_size(size_t size)
+{
+    if(size >= HUGE_PAGE_SIZE)
+        size = (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+    return size;
+}
+
+uint8_t * pool_alloc(size_t size)
+{
+    size_t align = (size >= HUGE_PAGE_SIZE) ? HUGE_PAGE_SIZE : 64;
+    void * buffer;
+
+    size = pool_size(size);
+    buffer = memory_alloc(size, align);
+    if(buffer == NULL)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    if(align == HUGE_PAGE_SIZE)
+        madvise(buffer, size, MADV_HUGEPAGE);
+#endif
+
+    return (uint8_t*)buffer;
+}
+
+void pool_free(uint8_t * buffer, size_t size)
+{
+    memory_free(buffer, pool_size(size));
+}
+
+struct pipeline
+{
+    pipeline(struct pdf_info * pdf, struct urf_options * options)
+      : bands(PIPELINE_BANDS),
+        pages(PIPELINE_PAGES),
+        pdf(pdf),
+        pwg(NULL),
+        options(options),
+        state(current_job),
+        workers(NULL),
+        callbacks(NULL),
+        images(true),
+        announced(-1),
+        failed(false)
+    {
+        if(options->threads > 1)
+            workers = new worker_pool(options->threads, state);
+    }
+
+    ~pipeline()
+    {
+        unsigned i;
+
+        delete workers;
+        for(i = 0 ; i < pool.bands.size() ; ++i)
+            delete pool.bands[i];
+        for(i = 0 ; i < pool.encoders.size() ; ++i)
+        {
+            image_encoder_end(pool.encoders[i]);
+            delete pool.encoders[i];
+        }
+    }
+
+    bounded_queue<struct raster_band *> bands;
+    bounded_queue<struct pdf_page *> pages;
+    struct pdf_info * pdf;
+    struct pwg_info * pwg;    // set instead of pdf by urftopwg
+    struct urf_options * options;
+    struct job_state * state; // of the job creating it, entered by the stage threads
+    worker_pool * workers;    // strip compression, NULL when single threaded
+    struct buffer_pool pool;
+    const struct unirast_params * callbacks;    // of the library job, NULL if none
+    bool images;              // pages are encoded, false when only the callbacks want them
+    int announced;            // last page given to the page callback
+    std::atomic<bool> failed; // bands and pages are only released from then on
+    std::mutex error_lock;
+    std::string error;        // first one
+};
+
+void pipeline_fail(struct pipeline * pl, const char * error)
+{
+    std::lock_guard<std::mutex> guard(pl->error_lock);
+
+    if(!pl->failed)
+    {
+        try {
+            pl->error = error;
+        } catch (...) {
+        }
+    }
+    pl->failed = true;
+}
+
+void band_release(struct pipeline * pl, struct raster_band * band);
+
+struct raster_band * band_new(struct pipeline * pl, struct pdf_page * page, unsigned first_line)
+{
+    struct raster_band * band = NULL;
+    bool empty = (page == NULL || !page_has_raster(page));   // end of job or page marker
+    size_t line_bytes = empty ? 0 : page->line_bytes;
+
+    // RLE and PWG lines are stored encoded, in slots sized for the worst case
+    if(!empty && rle_encoding(page->encoding))
+        line_bytes = rle_line_bound(line_bytes);
+    else if(!empty && page->encoding == ENCODING_PWG)
+        line_bytes = pwg_line_bound(line_bytes, page->width);
+
+    {
+        std::lock_guard<std::mutex> guard(pl->pool.lock);
+
+        if(!pl->pool.bands.empty())
+        {
+            band = pl->pool.bands.back();
+            pl->pool.bands.pop_back();
+        }
+    }
+
+    try {
+        if(band == NULL)
+            band = new raster_band;
+        band->page = page;
+        band->last = false;
+        band->first_line = first_line;
+        band->height = 0;
+        band->max_height = page ? page->strip_lines : 0;
+        band->lines = 0;
+        if(empty)
+            band->capacity = 0;
+        else if(band->max_height)
+            band->capacity = band->max_height;
+        else
+            band->capacity = BAND_BYTES / (line_bytes ? line_bytes : 1);
+        if(band->capacity == 0 && !empty)
+            band->capacity = 1;
+        band->slot_bytes = line_bytes;
+        band->repeats.resize(band->capacity);
+        band->sizes.resize(band->capacity);
+    } catch (...) {
+        if(band)
+            band_release(pl, band);
+        die("Unable to allocate band");
+    }
+
+    if(band->capacity * line_bytes > band->data_size)
+    {
+        size_t size = band->capacity * line_bytes;
+
+        stats_memory(-(int64_t)band->data_size);
+        pool_free(band->data, band->data_size);
+        band->data_size = 0;
+        if((band->data = pool_alloc(size)) == NULL)
+        {
+            band_release(pl, band);
+            die("Unable to allocate band");
+        }
+        stats_memory(size);
+        band->data_size = size;
+    }
+
+    return band;
+}
+
+// Give a band back to the pool once compressed
+void band_release(struct pipeline * pl, struct raster_band * band)
+{
+    std::lock_guard<std::mutex> guard(pl->pool.lock);
+
+    try {
+        pl->pool.bands.push_back(band);
+    } catch (...) {
+        delete band;
+    }
+}
+
+// Where the next line of the band is to be decoded
+static inline uint8_t * band_line(struct raster_band * band)
+{
+    return &band->data[band->lines*band->slot_bytes];
+}
+
+void compress_band_now(struct pipeline * pl, struct image_encoder * enc, struct raster_band * band);
+
+// Bands go to compress_stage(), or straight to the encoder of the page in page mode
+void band_push(struct pipeline * pl, struct raster_band * band)
+{
+    if(band->page && band->page->encoder)
+        compress_band_now(pl, band->page->encoder, band);
+    else
+        pl->bands.push(band);
+}
+
+// A page failing to decode: its last band takes it to write_stage(), which drops it
+void band_abort(struct pipeline * pl, struct raster_band * band, const char * error)
+{
+    pipeline_fail(pl, error);
+    band->last = true;
+    band_push(pl, band);
+}
+
+/*
+ * Account the line written at band_line() for line_repeat output lines and
+ * pass full bands on.  A repeat crossing a strip boundary is split between
+ * both strips.
+ */
+void band_add_line(struct pipeline * pl, struct raster_band *& band, size_t size, unsigned line_repeat, unsigned & cur_line)
+{
+    struct pdf_page * page = band->page;
+    const uint8_t * line = band_line(band);
+
+    for(;;)
+    {
+        unsigned count = line_repeat;
+
+        if(band->max_height && count > band->max_height - band->height)
+            count = band->max_height - band->height;
+
+        band->sizes[band->lines] = size;
+        band->repeats[band->lines++] = count;
+        band->height += count;
+        cur_line += count;
+        line_repeat -= count;
+
+        if((band->lines == band->capacity || band->height == band->max_height) && cur_line < page->height)
+        {
+            struct raster_band * next = band_new(pl, page, cur_line);
+
+            // Carry the rest of the repeat over
+            if(line_repeat)
+            {
+                memcpy(band_line(next), line, size);
+                line = band_line(next);
+            }
+
+            band_push(pl, band);
+            band = next;
+        }
+
+        if(line_repeat == 0)
+            break;
+    }
+}
+
+void compress_sink(void * ctx, const uint8_t * data, size_t size)
+{
+    image_buffer * image_data = (image_buffer *)ctx;
+
+    image_data->insert(image_data->end(), data, data + size);
+    stats_memory(size);
+}
+
+struct image_encoder * encoder_get(struct pipeline * pl)
+{
+    struct image_encoder * enc = NULL;
+    std::lock_guard<std::mutex> guard(pl->pool.lock);
+
+    if(!pl->pool.encoders.empty())
+    {
+        enc = pl->pool.encoders.back();
+        pl->pool.encoders.pop_back();
+        return enc;
+    }
+
+    try {
+        enc = new image_encoder();
+    } catch (...) {
+        die("Unable to allocate page data");
+    }
+
+    return enc;
+}
+
+void encoder_release(struct pipeline * pl, struct image_encoder * enc)
+{
+    std::lock_guard<std::mutex> guard(pl->pool.lock);
+
+    try {
+        pl->pool.encoders.push_back(enc);
+    } catch (...) {
+        image_encoder_end(enc);
+        delete enc;
+    }
+}
+
+// An encoder left in the middle of an image by a failure starts afresh
+void encoder_discard(struct pipeline * pl, struct image_encoder * enc)
+{
+    image_encoder_end(enc);
+    encoder_release(pl, enc);
+}
+
+// Strips take the compressed data buffer of an earlier page if any
+void image_data_get(struct pipeline * pl, struct pdf_strip * strip)
+{
+    std::lock_guard<std::mutex> guard(pl->pool.lock);
+
+    if(!pl->pool.image_data.empty())
+    {
+        strip->image_data.swap(pl->pool.image_data.back());
+        pl->pool.image_data.pop_back();
+    }
+}
+
+void image_data_release(struct pipeline * pl, struct pdf_strip * strip)
+{
+    std::lock_guard<std::mutex> guard(pl->pool.lock);
+
+    strip->image_data.clear();
+    try {
+        pl->pool.image_data.push_back(image_buffer());
+        pl->pool.image_data.back().swap(strip->image_data);
+    } catch (...) {
+    }
+}
+
+void compress_begin(struct image_encoder * enc, struct pdf_page * page, struct pdf_strip * strip)
+{
+    if(image_encoder_begin(enc, page->encoding, page->predictor, (page->components*page->bits + 7)/8, page->width, strip->height,
+                           page->line_bytes, page->quality, compress_sink, &strip->image_data) != 0)
+        die("Unable to allocate page data");
+}
+
+void compress_band(struct image_encoder * enc, struct raster_band * band)
+{
+    unsigned i;
+
+    for(i = 0 ; i < band->lines ; ++i)
+    {
+        if(image_encoder_write(enc, &band->data[i*band->slot_bytes], band->sizes[i], band->repeats[i]) != 0)
+            die("Unable to compress page data");
+    }
+}
+
+// Strip mode: one band is one strip, deflated as a whole on a worker
+void compress_strip(struct pipeline * pl, struct raster_band * band, struct pdf_strip * strip)
+{
+    struct image_encoder * enc = NULL;
+    struct stage_clock clock;
+    uint64_t start = clock_ns(CLOCK_MONOTONIC);
+
+    // Errors reach write_stage() through the future of the strip
+    try {
+        enc = encoder_get(pl);
+        stage_start(&clock);
+        compress_begin(enc, band->page, strip);
+        compress_band(enc, band);
+        if(image_encoder_finish(enc) != 0) die("Unable to compress page data");
+        stage_stop(&clock, STAGE_COMPRESS);
+    } catch (...) {
+        if(enc)
+            encoder_discard(pl, enc);
+        band_release(pl, band);
+        throw;
+    }
+    strip->compress_ns = clock_ns(CLOCK_MONOTONIC) - start;
+
+    encoder_release(pl, enc);
+    band_release(pl, band);
+}
+
+// Compress a band on the calling thread, a strip or the next lines of the page
+void compress_band_now(struct pipeline * pl, struct image_encoder * enc, struct raster_band * band)
+{
+    struct pdf_page * page = band->page;
+    struct stage_clock clock;
+
+    if(!page_has_raster(page) || pl->failed)
+    {
+        band_release(pl, band);
+        return;
+    }
+
+    uint64_t start = clock_ns(CLOCK_MONOTONIC);
+    stage_start(&clock);
+    if(page->strip_lines || band->first_line == 0)
+    {
+        page->strips.push_back(pdf_strip());
+        struct pdf_strip * strip = &page->strips.back();
+        strip->y = band->first_line;
+        strip->height = page->strip_lines ? band->height : page->height;
+        image_data_get(pl, strip);
+        compress_begin(enc, page, strip);
+    }
+
+    compress_band(enc, band);
+
+    if(page->strip_lines || band->last)
+    {
+        if(image_encoder_finish(enc) != 0) die("Unable to compress page data");
+    }
+    stage_stop(&clock, STAGE_COMPRESS);
+    page->strips.back().compress_ns += clock_ns(CLOCK_MONOTONIC) - start;
+
+    band_release(pl, band);
+}
+
+void unirast_page_info(const struct pdf_page * page, struct unirast_page * info)
+{
+    memset(info, 0, sizeof(*info));
+    info->number = page->number;
+    info->width = page->width;
+    info->height = page->height;
+    info->components = page->components;
+    info->bits = page->bits;
+    info->line_bytes = page->line_bytes;
+    info->urf_width = page->urf_width;
+    info->urf_height = page->urf_height;
+    info->dpi = page->dpi;
+    info->colorspace = page->colorspace;
+    info->duplex = page->urf_duplex;
+    info->quality = page->urf_quality;
+}
+
+// Library jobs: the page once, then its decoded rows as the bands come
+void band_callbacks(struct pipeline * pl, struct raster_band * band)
+{
+    const struct unirast_params * cb = pl->callbacks;
+    struct pdf_page * page = band->page;
+    struct unirast_page info;
+    unsigned i, y = band->first_line;
+
+    unirast_page_info(page, &info);
+    if((int)page->number != pl->announced)
+    {
+        pl->announced = page->number;
+        if(cb->page && cb->page(cb->ctx, &info) != 0)
+            die("Job aborted by the page callback");
+    }
+
+    if(cb->rows == NULL || !page_has_raster(page))
+        return;
+    for(i = 0 ; i < band->lines ; y += band->repeats[i++])
+    {
+        if(cb->rows(cb->ctx, &info, y, &band->data[i*band->slot_bytes], band->repeats[i]) != 0)
+            die("Job aborted by the rows callback");
+    }
+}
+
+void compress_stage(struct pipeline * pl)
+{
+    struct image_encoder * enc = NULL;
+    struct raster_band * band;
+
+    job_enter(pl->state);
+    while((band = pl->bands.pop())->page != NULL)
+    {
+        struct pdf_page * page = band->page;
+        bool last = band->last;
+
+        try {
+            if(pl->failed)
+                band_release(pl, band);
+            else
+            {
+                if(pl->callbacks)
+                    band_callbacks(pl, band);
+
+                if(!pl->images)
+                    band_release(pl, band);
+                else if(page_has_raster(page) && page->strip_lines && pl->workers)
+                {
+                    page->strips.push_back(pdf_strip());
+                    struct pdf_strip * strip = &page->strips.back();
+                    strip->y = band->first_line;
+                    strip->height = band->height;
+                    image_data_get(pl, strip);
+                    strip->done = pl->workers->submit(std::bind(compress_strip, pl, band, strip));
+                }
+                else
+                {
+                    if(enc == NULL)
+                        enc = encoder_get(pl);
+                    compress_band_now(pl, enc, band);
+                }
+            }
+        } catch (std::exception & e) {
+            // Bands are only released once done with
+            pipeline_fail(pl, e.what());
+            band_release(pl, band);
+            if(enc)
+                encoder_discard(pl, enc);
+            enc = NULL;
+        }
+
+        if(last)
+            pl->pages.push(page);
+    }
+
+    band_release(pl, band);
+    if(enc)
+        encoder_release(pl, enc);
+    pl->pages.push(NULL);
+}
+
+// A page to the PDF or PWG Raster file, if any
+int output_page(struct pipeline * pl, struct pdf_page * page)
+{
+    if(pl->pwg)
+        return add_pwg_page(pl->pwg, page);
+    if(pl->pdf == NULL)
+        return 0;
+    if(page->same_as >= 0)
+        return add_pdf_page_copy(pl->pdf, page->same_as);
+
+    return add_pdf_page(pl->pdf, page);
+}
+
+int output_page_copy(struct pipeline * pl, unsigned number)
+{
+    if(pl->pwg)
+        return add_pwg_page_copy(pl->pwg, number);
+    if(pl->pdf == NULL)
+        return 0;
+
+    return add_pdf_page_copy(pl->pdf, number);
+}
+
+void write_stage(struct pipeline * pl)
+{
+    struct pdf_page * page;
+
+    job_enter(pl->state);
+    while((page = pl->pages.pop()) != NULL)
+    {
+        struct stage_clock clock;
+        size_t image_bytes = 0;
+        uint64_t compress_ns = 0;
+
+        // Strips may still be on the workers, keep the page order
+        for(std::deque<struct pdf_strip>::iterator strip = page->strips.begin() ; strip != page->strips.end() ; ++strip)
+        {
+            try {
+                if(strip->done.valid())
+                    strip->done.get();
+            } catch (std::exception & e) {
+                pipeline_fail(pl, e.what());
+            }
+            image_bytes += strip->image_data.size();
+            compress_ns += strip->compress_ns;
+        }
+
+        if(tuner->budget_ns && page_has_raster(page) && deflate_encoding(page->encoding) && !pl->failed)
+        {
+            // Strips on the workers are compressed side by side
+            if(pl->workers && page->strip_lines)
+                compress_ns /= std::min<size_t>(pl->options->threads, page->strips.size());
+            deflate_tuner_update(page->number, page->quality, compress_ns);
+        }
+
+        // Uncollated copies follow each page
+        unsigned source = (page->same_as >= 0) ? page->same_as : page->number;
+        unsigned copy;
+
+        try {
+            if(!pl->failed)
+            {
+                stage_start(&clock);
+                if(output_page(pl, page) != 0) die("Unable to create output file");
+                for(copy = 1 ; !pl->options->collate && copy < pl->options->copies ; ++copy)
+                    if(output_page_copy(pl, source) != 0) die("Unable to create output file");
+                stage_stop(&clock, STAGE_WRITE);
+            }
+        } catch (std::exception & e) {
+            pipeline_fail(pl, e.what());
+        }
+
+        // The backend has its own copy of the images
+        for(std::deque<struct pdf_strip>::iterator strip = page->strips.begin() ; strip != page->strips.end() ; ++strip)
+            image_data_release(pl, &*strip);
+        delete page;
+
+        if(stats->enabled)
+        {
+            stats->image_bytes += image_bytes;
+            stats_memory(-(int64_t)image_bytes);
+        }
+    }
+}
+
+//------------- URF ---------------
+
+// Data are in network endianness
+struct urf_file_header {
+    char unirast[8];
+    uint32_t page_count;
+} __attribute__((__packed__));
+
+struct urf_page_header {
+    uint8_t bpp;
+    uint8_t colorspace;
+    uint8_t duplex;
+    uint8_t quality;
+    uint32_t unknown0;
+    uint32_t unknown1;
+    uint32_t width;
+    uint32_t height;
+    uint32_t dot_per_inch;
+    uint32_t unknown2;
+    uint32_t unknown3;
+} __attribute__((__packed__));
+
+#define MAX_LINE_BYTES (64*1024*1024)
+
+// Samples in a pixel of the given URF color space, 0 if unknown
+unsigned urf_components(unsigned colorspace)
+{
+    switch(colorspace)
+    {
+        case UNIRAST_COLOR_SPACE_GRAYSCALE_8BIT:
+        case UNIRAST_COLOR_SPACE_GRAYSCALE_32BIT:
+            return 1;
+        case UNIRAST_COLOR_SPACE_SRGB_24BIT_1:
+        case UNIRAST_COLOR_SPACE_SRGB_24BIT_3:
+        case UNIRAST_COLOR_SPACE_SRGB_24BIT_5:
+        case UNIRAST_COLOR_SPACE_SRGB_32BIT:
+            return 3;
+        case UNIRAST_COLOR_SPACE_CMYK_32BIT_64BIT:
+            return 4;
+    }
+
+    return 0;
+}
+
+// Fill n pixels with the same value
+template<unsigned PixelSize>
+static inline void fill_pixels(uint8_t * dst, const uint8_t * pixel, unsigned n)
+{
+    unsigned i;
+
+    if(PixelSize == 1)
+    {
+        memset(dst, pixel[0], n);
+    }
+    else if((PixelSize == 3 || PixelSize == 6) && n > 8)
+    {
+        // No native word for 3 or 6 bytes, double the already filled area instead
+        size_t done = PixelSize;
+        size_t total = (size_t)n*PixelSize;
+
+        memcpy(dst, pixel, PixelSize);
+        while(done < total)
+        {
+            size_t chunk = (done < total - done) ? done : (total - done);
+            memcpy(dst + done, dst, chunk);
+            done += chunk;
+        }
+    }
+    else
+    {
+        // Fixed size stores, vectorized by the compiler for 4 and 8 bytes pixels
+        for(i = 0 ; i < n ; ++i)
+            memcpy(dst + i*PixelSize, pixel, PixelSize);
+    }
+}
+
+//------------- RLE transcoding ---------------
+
+/*
+ * Writes one line in PDF RunLengthDecode format: a length byte 0-127 is
+ * followed by 1-128 literal bytes, 257-n is followed by a byte repeated n
+ * times.  Adjacent literals are merged, runs shorter than 3 bytes are not
+ * worth a run.
+ */
+struct rle_writer
+{
+    uint8_t * out;
+    uint8_t * literal;          // length byte of the open literal run
+    unsigned literal_count;     // 0 when no literal run is open
+};
+
+static inline void rle_literal(struct rle_writer * w, const uint8_t * data, size_t n)
+{
+    while(n > 0)
+    {
+        size_t chunk;
+
+        if(w->literal_count == 0 || w->literal_count == 128)
+        {
+            w->literal = w->out++;
+            w->literal_count = 0;
+        }
+
+        chunk = 128 - w->literal_count;
+        if(chunk > n)
+            chunk = n;
+
+        memcpy(w->out, data, chunk);
+        w->out += chunk;
+        w->literal_count += chunk;
+        *w->literal = w->literal_count - 1;
+        data += chunk;
+        n -= chunk;
+    }
+}
+
+static inline void rle_repeat(struct rle_writer * w, uint8_t value, size_t n)
+{
+    while(n >= 3)
+    {
+        size_t chunk = (n > 128) ? 128 : n;
+
+        *w->out++ = 257 - chunk;
+        *w->out++ = value;
+        w->literal_count = 0;
+        n -= chunk;
+    }
+
+    if(n > 0)
+    {
+        uint8_t tail[2] = { value, value };
+        rle_literal(w, tail, n);
+    }
+}
+
+// Pixel repeat: a byte run if all its samples are equal, a literal otherwise
+template<unsigned PixelSize>
+static inline void rle_repeat_pixel(struct rle_writer * w, const uint8_t * pixel, unsigned n)
+{
+    uint8_t pattern[128*PixelSize];
+    unsigned i;
+
+    for(i = 1 ; i < PixelSize ; ++i)
+        if(pixel[i] != pixel[0])
+            break;
+
+    if(i == PixelSize)
+    {
+        rle_repeat(w, pixel[0], (size_t)n*PixelSize);
+        return;
+    }
+
+    fill_pixels<PixelSize>(pattern, pixel, n);
+    rle_literal(w, pattern, (size_t)n*PixelSize);
+}
+
+// Keeps the high byte of n big endian 16-bit samples
+static inline void reduce_samples(uint8_t * dst, const uint8_t * src, size_t n)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i high = _mm_set1_epi16(0x00FF);
+
+    for( ; i + 16 <= n ; i += 16)
+    {
+        __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i*)(src + 2*i)), high);
+        __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i*)(src + 2*i + 16)), high);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(a, b));
+    }
+#endif
+
+    for( ; i < n ; ++i)
+        dst[i] = src[2*i];
+}
+
+/*
+ * URF pixel layout: Components samples of SampleBytes, big endian, padded
+ * to PixelSize.  Stored pixels have OutComponents samples of OutBytes,
+ * OutComponents is either Components or 1 for gray from RGB.
+ */
+template<unsigned PixelSize, unsigned Components, unsigned SampleBytes, unsigned OutComponents, unsigned OutBytes>
+struct pixel_format
+{
+    static const unsigned pixel_size = PixelSize;
+    static const unsigned out_size = OutComponents*OutBytes;
+    static const unsigned out_bytes = OutBytes;
+    static const bool identity = (Components == OutComponents && SampleBytes == OutBytes && PixelSize == Components*SampleBytes);
+    static const uint8_t white = (Components == 4) ? 0x00 : 0xFF;    // no ink for CMYK
+    static const uint8_t out_white = (OutComponents == 4) ? 0x00 : 0xFF;
+
+    static inline unsigned sample(const uint8_t * pixel, unsigned i)
+    {
+        return (SampleBytes == 2) ? (pixel[2*i] << 8 | pixel[2*i + 1]) : pixel[i];
+    }
+
+    static inline void put(uint8_t * out, unsigned value)
+    {
+        if(OutBytes == 2)
+        {
+            out[0] = value >> 8;
+            out[1] = value;
+        }
+        else
+            out[0] = (SampleBytes == 2) ? (value >> 8) : value;
+    }
+
+    static inline void convert(uint8_t * dst, const uint8_t * src, unsigned n)
+    {
+        unsigned i, c;
+
+        if(identity)
+            memcpy(dst, src, (size_t)n*PixelSize);
+        else if(Components == OutComponents && SampleBytes == 2 && OutBytes == 1 && PixelSize == 2*Components)
+            reduce_samples(dst, src, (size_t)n*Components);
+        else if(Components == OutComponents)
+        {
+            // Drop the padding, and the low bytes if reducing
+            for(i = 0 ; i < n ; ++i, src += PixelSize, dst += out_size)
+                for(c = 0 ; c < Components ; ++c)
+                    put(dst + c*OutBytes, sample(src, c));
+        }
+        else if(Components == 4)
+        {
+            // CMYK to RGB without color management, for PCLm
+            const unsigned max = (SampleBytes == 2) ? 0xFFFF : 0xFF;
+
+            for(i = 0 ; i < n ; ++i, src += PixelSize, dst += out_size)
+                for(c = 0 ; c < 3 ; ++c)
+                {
+                    unsigned ink = sample(src, c) + sample(src, 3);
+                    put(dst + c*OutBytes, (ink < max) ? max - ink : 0);
+                }
+        }
+        else
+        {
+            // RGB to luma, exact for neutral pixels
+            for(i = 0 ; i < n ; ++i, src += PixelSize, dst += out_size)
+                put(dst, (77*sample(src, 0) + 150*sample(src, 1) + 29*sample(src, 2) + 128) >> 8);
+        }
+    }
+
+    // Only looks at the samples, not at the padding
+    static inline bool is_uniform(const uint8_t * pixel, uint8_t value)
+    {
+        unsigned i;
+
+        for(i = 0 ; i < Components*SampleBytes ; ++i)
+            if(pixel[i] != value)
+                return false;
+        return true;
+    }
+
+    static inline bool is_neutral(const uint8_t * pixel)
+    {
+        return Components != 3 || (sample(pixel, 0) == sample(pixel, 1) && sample(pixel, 1) == sample(pixel, 2));
+    }
+};
+
+/*
+ * Line writers used by decode_raster_t: pixel_writer expands the URF codes
+ * to raw pixels, rle_line_writer transcodes them to RunLengthDecode and
+ * pwg_line_writer to PWG Raster codes.
+ */
+template<class Format>
+struct pixel_writer
+{
+    uint8_t * line;
+    size_t line_bytes;
+
+    void begin(uint8_t * out, size_t bytes) { line = out; line_bytes = bytes; }
+    void blank(unsigned pos, unsigned n) { memset(line + (size_t)pos*Format::out_size, Format::out_white, (size_t)n*Format::out_size); }
+    void repeat(unsigned pos, const uint8_t * pixel, unsigned n)
+    {
+        uint8_t out[Format::out_size];
+        Format::convert(out, pixel, 1);
+        fill_pixels<Format::out_size>(line + (size_t)pos*Format::out_size, out, n);
+    }
+    void copy(unsigned pos, const uint8_t * pixels, unsigned n) { Format::convert(line + (size_t)pos*Format::out_size, pixels, n); }
+    size_t end() { return line_bytes; }
+};
+
+template<class Format>
+struct rle_line_writer
+{
+    struct rle_writer w;
+    uint8_t * line;
+
+    void begin(uint8_t * out, size_t) { line = w.out = out; w.literal = NULL; w.literal_count = 0; }
+    void blank(unsigned, unsigned n) { rle_repeat(&w, Format::out_white, (size_t)n*Format::out_size); }
+    void repeat(unsigned, const uint8_t * pixel, unsigned n)
+    {
+        uint8_t out[Format::out_size];
+        Format::convert(out, pixel, 1);
+        rle_repeat_pixel<Format::out_size>(&w, out, n);
+    }
+    void copy(unsigned, const uint8_t * pixels, unsigned n)
+    {
+        uint8_t out[128*Format::out_size];
+
+        if(Format::identity)
+        {
+            rle_literal(&w, pixels, (size_t)n*Format::pixel_size);
+            return;
+        }
+
+        // URF literals are at most 128 pixels long
+        Format::convert(out, pixels, n);
+        rle_literal(&w, out, (size_t)n*Format::out_size);
+    }
+    size_t end() { return w.out - line; }
+};
+
+// PWG codes are the URF ones, only the pixels change, the line repeat byte is left to the encoder
+template<class Format>
+struct pwg_line_writer
+{
+    uint8_t * line;
+    uint8_t * out;
+
+    void begin(uint8_t * dst, size_t) { line = out = dst; }
+    void blank(unsigned, unsigned) { *out++ = RLE_EOD; }
+    void repeat(unsigned, const uint8_t * pixel, unsigned n)
+    {
+        *out++ = n - 1;
+        Format::convert(out, pixel, 1);
+        out += Format::out_size;
+    }
+    void copy(unsigned, const uint8_t * pixels, unsigned n)
+    {
+        // A literal cut to one pixel by the end of the line becomes a repeat
+        *out++ = (n == 1) ? 0 : 257 - n;
+        Format::convert(out, pixels, n);
+        out += (size_t)n*Format::out_size;
+    }
+    size_t end() { return out - line; }
+};
+
+// Sets n bits of a 1-bit line from pos on
+static inline void fill_bits(uint8_t * line, unsigned pos, unsigned n, bool value)
+{
+    uint8_t fill = value ? 0xFF : 0x00;
+
+    while(n > 0 && (pos & 7))
+    {
+        uint8_t mask = 0x80 >> (pos & 7);
+        line[pos >> 3] = value ? (line[pos >> 3] | mask) : (line[pos >> 3] & ~mask);
+        ++pos;
+        --n;
+    }
+
+    memset(line + (pos >> 3), fill, n >> 3);
+    pos += n & ~7u;
+    n &= 7;
+
+    if(n > 0)
+    {
+        uint8_t mask = 0xFF00 >> n;
+        line[pos >> 3] = value ? (line[pos >> 3] | mask) : (line[pos >> 3] & ~mask);
+    }
+}
+
+// Packs bilevel pages to 1 bit per pixel, 1 is white
+template<unsigned PixelSize>
+struct bit_writer
+{
+    uint8_t * line;
+    size_t line_bytes;
+
+    void begin(uint8_t * out, size_t bytes)
+    {
+        line = out;
+        line_bytes = bytes;
+        // Padding bits stay 0
+        if(bytes)
+            line[bytes - 1] = 0;
+    }
+    void blank(unsigned pos, unsigned n) { fill_bits(line, pos, n, true); }
+    void repeat(unsigned pos, const uint8_t * pixel, unsigned n) { fill_bits(line, pos, n, pixel[0] != 0); }
+    void copy(unsigned pos, const uint8_t * pixels, unsigned n)
+    {
+        unsigned i;
+
+        for(i = 0 ; i < n ; ++i, ++pos, pixels += PixelSize)
+        {
+            uint8_t mask = 0x80 >> (pos & 7);
+            line[pos >> 3] = pixels[0] ? (line[pos >> 3] | mask) : (line[pos >> 3] & ~mask);
+        }
+    }
+    size_t end() { return line_bytes; }
+};
+
+// Feeds the decoded lines of a page to the pipeline
+template<class LineWriter>
+struct band_output : LineWriter
+{
+    struct pipeline * pl;
+    struct raster_band * band;
+    unsigned cur_line;
+    struct raster_counts counts;
+
+    void begin_line() { this->begin(band_line(band), band->page->line_bytes); }
+    void blank(unsigned pos, unsigned n)
+    {
+        counts.fill_codes++;
+        LineWriter::blank(pos, n);
+    }
+    void repeat(unsigned pos, const uint8_t * pixel, unsigned n)
+    {
+        counts.repeat_codes++;
+        LineWriter::repeat(pos, pixel, n);
+    }
+    void copy(unsigned pos, const uint8_t * pixels, unsigned n)
+    {
+        counts.literal_codes++;
+        LineWriter::copy(pos, pixels, n);
+    }
+    bool end_line(unsigned line_repeat)
+    {
+        counts.lines++;
+        counts.repeated_lines += line_repeat - 1;
+        band_add_line(pl, band, this->end(), line_repeat, cur_line);
+        return true;
+    }
+};
+
+// Page properties found by scan_raster(), set on input those to look for
+struct page_scan
+{
+    bool neutral;       // R == G == B for every pixel
+    bool white;         // blank page, nothing to draw
+    bool bilevel;       // only black and white pixels
+    bool photo;         // continuous tone, see PHOTO_LITERALS
+    bool whole;         // scan up to the end of the raster to fingerprint it
+    uint64_t changes;   // black/white transitions along the lines, for bilevel
+    uint64_t hash;      // of the raster bytes when whole, seeded on input
+    size_t raster_size; // bytes, when whole
+};
+
+/*
+ * Photos leave PackBits few runs to find, most of their pixels are in
+ * literals or in runs of a pixel or two.  Pages with at least one pixel in
+ * PHOTO_LITERALS of those are taken as photos, text and graphics have a
+ * few percent at most.
+ */
+#define PHOTO_LITERALS 5
+#define PHOTO_SHORT_RUN 2
+
+// Looks at the pixels without storing them, stops once nothing is left to find
+template<class Format>
+struct page_scanner : page_scan
+{
+    bool last_white;
+    unsigned line_changes;
+    unsigned line_literals;
+    uint64_t literals;
+    uint64_t photo_literals;    // enough literals for a photo
+
+    inline void check(const uint8_t * pixel)
+    {
+        bool is_white = Format::is_uniform(pixel, Format::white);
+
+        if(white && !is_white)
+            white = false;
+        if(neutral && !Format::is_neutral(pixel))
+            neutral = false;
+        if(bilevel)
+        {
+            if(!is_white && !Format::is_uniform(pixel, 0x00))
+                bilevel = false;
+            else if(is_white != last_white)
+            {
+                last_white = is_white;
+                ++line_changes;
+            }
+        }
+    }
+
+    void begin_line()
+    {
+        last_white = true;
+        line_changes = 0;
+        line_literals = 0;
+    }
+    void blank(unsigned, unsigned)
+    {
+        if(!last_white)
+        {
+            last_white = true;
+            ++line_changes;
+        }
+    }
+    void repeat(unsigned, const uint8_t * pixel, unsigned n)
+    {
+        if(n <= PHOTO_SHORT_RUN)
+            line_literals += n;
+        check(pixel);
+    }
+    void copy(unsigned, const uint8_t * pixels, unsigned n)
+    {
+        unsigned i;
+
+        line_literals += n;
+        for(i = 0 ; (neutral || white || bilevel) && i < n ; ++i, pixels += Format::pixel_size)
+            check(pixels);
+    }
+    bool end_line(unsigned line_repeat)
+    {
+        changes += (uint64_t)line_changes*line_repeat;
+        literals += (uint64_t)line_literals*line_repeat;
+        return neutral || white || bilevel || whole || (photo && literals < photo_literals);
+    }
+};
+
+/*
+ * Walks the PackBits codes of one page and hands the pixels to out, which
+ * can stop the walk early by returning false from end_line().
+ */
+template<unsigned PixelSize, class Output>
+int parse_raster_t(struct urf_input * in, unsigned width, unsigned height, Output & out)
+{
+    // We should be at raster start
+    unsigned cur_line = 0;
+    unsigned pos = 0;
+    unsigned line_repeat = 0;
+    int8_t packbit_code = 0;
+
+    while(cur_line < height)
+    {
+        if(!input_ensure(in, 1))
+        {
+            dprintf("l%06d : line_repeat EOF at %lu\n", cur_line, (unsigned long)input_tell(in));
+            return 1;
+        }
+
+        line_repeat = (unsigned)*in->cur++ + 1;
+
+        dprintf("l%06d : next actions for %d lines\n", cur_line, line_repeat);
+
+        out.begin_line();
 
         // Start of line
         pos = 0;
 
-        do
+        do
+        {
+            if(!input_ensure(in, 1))
+            {
+                dprintf("p%06dl%06d : packbit_code EOF at %lu\n", pos, cur_line, (unsigned long)input_tell(in));
+                return 1;
+            }
+
+            packbit_code = (int8_t)*in->cur++;
+
+            dprintf("p%06dl%06d: Raster code %02X='%d'.\n", pos, cur_line, (uint8_t)packbit_code, packbit_code);
+
+            if(packbit_code == -128)
+            {
+                dprintf("\tp%06dl%06d : blank rest of line.\n", pos, cur_line);
+                out.blank(pos, width - pos);
+                pos = width;
+            }
+            else if(packbit_code >= 0)
+            {
+                unsigned n = (unsigned)packbit_code + 1;
+
+                if(!input_ensure(in, PixelSize))
+                {
+                    dprintf("p%06dl%06d : pixel repeat EOF at %lu\n", pos, cur_line, (unsigned long)input_tell(in));
+                    return 1;
+                }
+
+                dprintf("\tp%06dl%06d : Repeat pixel for %d times.\n", pos, cur_line, n);
+
+                if(n > width - pos)
+                {
+                    dprintf("\tp%06dl%06d : Forced end of line for pixel repeat.\n", pos, cur_line);
+                    n = width - pos;
+                }
+
+                out.repeat(pos, in->cur, n);
+                in->cur += PixelSize;
+                pos += n;
+            }
+            else
+            {
+                unsigned n = (unsigned)(-(int)packbit_code) + 1;
+                size_t run_bytes = (size_t)n*PixelSize;
+
+                dprintf("\tp%06dl%06d : Copy %d verbatim pixels.\n", pos, cur_line, n);
+
+                if(!input_ensure(in, run_bytes))
+                {
+                    dprintf("p%06dl%06d : literal_pixel EOF at %lu\n", pos, cur_line, (unsigned long)input_tell(in));
+                    return 1;
+                }
+
+                if(n > width - pos)
+                {
+                    dprintf("\tp%06dl%06d : Forced end of line for pixel copy.\n", pos, cur_line);
+                    n = width - pos;
+                }
+
+                out.copy(pos, in->cur, n);
+                in->cur += run_bytes;
+                pos += n;
+            }
+        }
+        while(pos < width);
+
+        if(line_repeat > height - cur_line)
+        {
+            dprintf("\tl%06d : Forced end of page for line repeat.\n", cur_line);
+            line_repeat = height - cur_line;
+        }
+
+        dprintf("\tl%06d : End Of line, drawing %d times.\n", cur_line, line_repeat);
+
+        cur_line += line_repeat;
+
+        if(!out.end_line(line_repeat))
+            break;
+    }
+
+    return 0;
+}
+
+/*
+ * Box filter for urf-max-dpi: each image pixel is the average of a
+ * downsample x downsample square of URF pixels.  Decoded lines are summed
+ * as they come, line repeats included, then reduced along the line once a
+ * whole square of lines is in.
+ */
+#define MAX_DOWNSAMPLE 255      // keeps 16-bit sample sums in 32 bits
+
+// acc[i] += count*sample i of line, for n samples of bytes each
+static void box_add_line(uint32_t * acc, const uint8_t * line, size_t n, unsigned count, unsigned bytes)
+{
+    size_t i = 0;
+
+    if(bytes == 2)
+    {
+        for( ; i < n ; ++i)
+            acc[i] += (line[2*i] << 8 | line[2*i + 1])*count;
+        return;
+    }
+
+#ifdef __SSE2__
+    // count*255 fits in 16 bits
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i mul = _mm_set1_epi16(count);
+
+    for( ; i + 16 <= n ; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(line + i));
+        __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(v, zero), mul);
+        __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(v, zero), mul);
+        __m128i * a = (__m128i*)(acc + i);
+
+        _mm_storeu_si128(a, _mm_add_epi32(_mm_loadu_si128(a), _mm_unpacklo_epi16(lo, zero)));
+        _mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1), _mm_unpackhi_epi16(lo, zero)));
+        _mm_storeu_si128(a + 2, _mm_add_epi32(_mm_loadu_si128(a + 2), _mm_unpacklo_epi16(hi, zero)));
+        _mm_storeu_si128(a + 3, _mm_add_epi32(_mm_loadu_si128(a + 3), _mm_unpackhi_epi16(hi, zero)));
+    }
+#endif
+
+    for( ; i < n ; ++i)
+        acc[i] += line[i]*count;
+}
+
+template<class Format>
+struct downsample_output : band_output<pixel_writer<Format> >
+{
+    static const unsigned components = Format::out_size/Format::out_bytes;
+
+    unsigned factor;
+    unsigned width;             // URF pixels
+    unsigned lines_left;        // URF lines still to come
+    unsigned rows;              // URF lines summed in acc
+    std::vector<uint8_t> full;  // decoded URF line
+    std::vector<uint32_t> acc;
+
+    void begin_line() { this->begin(&full[0], full.size()); }
+
+    // Averages the squares into the next image line, output repeat times
+    void flush(unsigned repeat)
+    {
+        uint8_t * line = band_line(this->band);
+        struct pdf_page * page = this->band->page;
+        unsigned x, c, i;
+
+        if(page->bits == 1)
+            memset(line, 0, page->line_bytes);
+
+        for(x = 0 ; x < page->width ; ++x)
+        {
+            unsigned first = x*factor;
+            unsigned columns = (width - first < factor) ? width - first : factor;
+            uint32_t count = columns*rows;
+
+            for(c = 0 ; c < components ; ++c)
+            {
+                uint32_t sum = 0;
+
+                for(i = 0 ; i < columns ; ++i)
+                    sum += acc[(first + i)*components + c];
+                sum = (sum + count/2)/count;
+
+                // Bilevel pages stay bilevel, 1 is white
+                if(page->bits == 1)
+                {
+                    if(sum >= 128)
+                        line[x >> 3] |= 0x80 >> (x & 7);
+                }
+                else if(Format::out_bytes == 2)
+                {
+                    line[(x*components + c)*2] = sum >> 8;
+                    line[(x*components + c)*2 + 1] = sum;
+                }
+                else
+                    line[x*components + c] = sum;
+            }
+        }
+
+        band_add_line(this->pl, this->band, page->line_bytes, repeat, this->cur_line);
+        std::fill(acc.begin(), acc.end(), 0);
+        rows = 0;
+    }
+
+    bool end_line(unsigned line_repeat)
+    {
+        size_t samples = (size_t)width*components;
+
+        this->counts.lines++;
+        this->counts.repeated_lines += line_repeat - 1;
+        lines_left -= line_repeat;
+
+        while(line_repeat > 0)
+        {
+            if(rows == 0 && line_repeat >= factor)
+            {
+                // Whole squares of this line alone, they all average the same
+                box_add_line(&acc[0], &full[0], samples, 1, Format::out_bytes);
+                rows = 1;
+                flush(line_repeat/factor);
+                line_repeat %= factor;
+                continue;
+            }
+
+            unsigned count = (factor - rows < line_repeat) ? factor - rows : line_repeat;
+
+            box_add_line(&acc[0], &full[0], samples, count, Format::out_bytes);
+            rows += count;
+            line_repeat -= count;
+            if(rows == factor || (line_repeat == 0 && lines_left == 0))
+                flush(1);
+        }
+
+        return true;
+    }
+};
+
+template<class Format>
+int downsample_raster_t(struct urf_input * in, struct pdf_page * page, struct pipeline * pl)
+{
+    downsample_output<Format> out;
+
+    out.pl = pl;
+    out.band = band_new(pl, page, 0);
+    out.cur_line = 0;
+    memset(&out.counts, 0, sizeof(out.counts));
+    out.factor = page->downsample;
+    out.width = page->urf_width;
+    out.lines_left = page->urf_height;
+    out.rows = 0;
+
+    int ret = 1;
+    try {
+        try {
+            out.full.resize((size_t)page->urf_width*Format::out_size);
+            out.acc.assign((size_t)page->urf_width*out.components, 0);
+        } catch (...) {
+            die("Unable to allocate page data");
+        }
+
+        ret = parse_raster_t<Format::pixel_size>(in, page->urf_width, page->urf_height, out);
+    } catch (std::exception & e) {
+        band_abort(pl, out.band, e.what());
+        throw;
+    }
+    if(ret != 0)
+    {
+        band_abort(pl, out.band, "Failed to decode Page");
+        return 1;
+    }
+
+    out.band->last = true;
+    band_push(pl, out.band);
+    stats_add_counts(&out.counts);
+
+    return 0;
+}
+
+template<class Format, class LineWriter>
+int decode_raster_t(struct urf_input * in, struct pdf_page * page, struct pipeline * pl)
+{
+    band_output<LineWriter> out;
+
+    out.pl = pl;
+    out.band = band_new(pl, page, 0);
+    out.cur_line = 0;
+    memset(&out.counts, 0, sizeof(out.counts));
+
+    int ret = 1;
+    try {
+        ret = parse_raster_t<Format::pixel_size>(in, page->urf_width, page->urf_height, out);
+    } catch (std::exception & e) {
+        band_abort(pl, out.band, e.what());
+        throw;
+    }
+    if(ret != 0)
+    {
+        band_abort(pl, out.band, "Failed to decode Page");
+        return 1;
+    }
+
+    out.band->last = true;
+    band_push(pl, out.band);
+    stats_add_counts(&out.counts);
+
+    return 0;
+}
+
+template<class Format>
+int decode_raster_t(struct urf_input * in, struct pdf_page * page, struct pipeline * pl)
+{
+    if(page->downsample > 1)
+        return downsample_raster_t<Format>(in, page, pl);
+    if(page->bits == 1)
+        return decode_raster_t<Format, bit_writer<Format::pixel_size> >(in, page, pl);
+    if(rle_encoding(page->encoding))
+        return decode_raster_t<Format, rle_line_writer<Format> >(in, page, pl);
+    if(page->encoding == ENCODING_PWG)
+        return decode_raster_t<Format, pwg_line_writer<Format> >(in, page, pl);
+    else
+        return decode_raster_t<Format, pixel_writer<Format> >(in, page, pl);
+}
+
+// Picks the stored format: gray from RGB or not, RGB from CMYK, 16-bit samples kept or reduced
+template<unsigned PixelSize, unsigned Components, unsigned SampleBytes>
+int decode_raster_t(struct urf_input * in, struct pdf_page * page, struct pipeline * pl)
+{
+    if(Components == 4 && page->components == 3)
+        return decode_raster_t<pixel_format<PixelSize, Components, SampleBytes, 3, 1> >(in, page, pl);
+    if(page->components != Components)
+    {
+        if(page->bits == 16)
+            return decode_raster_t<pixel_format<PixelSize, Components, SampleBytes, 1, SampleBytes> >(in, page, pl);
+        return decode_raster_t<pixel_format<PixelSize, Components, SampleBytes, 1, 1> >(in, page, pl);
+    }
+
+    if(page->bits == 16)
+        return decode_raster_t<pixel_format<PixelSize, Components, SampleBytes, Components, SampleBytes> >(in, page, pl);
+    return decode_raster_t<pixel_format<PixelSize, Components, SampleBytes, Components, 1> >(in, page, pl);
+}
+
+int decode_raster(struct urf_input * in, struct pdf_page * page, struct pipeline * pl)
+{
+    switch(page->bpp*8 + page->urf_components)
+    {
+        case UNIRAST_BPP_8BIT*8 + 1:
+            return decode_raster_t<1, 1, 1>(in, page, pl);
+        case UNIRAST_BPP_24BIT*8 + 1:
+            return decode_raster_t<3, 1, 2>(in, page, pl);
+        case UNIRAST_BPP_24BIT*8 + 3:
+            return decode_raster_t<3, 3, 1>(in, page, pl);
+        case UNIRAST_BPP_32BIT*8 + 1:
+            return decode_raster_t<4, 1, 2>(in, page, pl);
+        case UNIRAST_BPP_32BIT*8 + 3:
+            return decode_raster_t<4, 3, 1>(in, page, pl);
+        case UNIRAST_BPP_32BIT*8 + 4:
+            return decode_raster_t<4, 4, 1>(in, page, pl);
+        case UNIRAST_BPP_64BIT*8 + 1:
+            return decode_raster_t<8, 1, 2>(in, page, pl);
+        case UNIRAST_BPP_64BIT*8 + 3:
+            return decode_raster_t<8, 3, 2>(in, page, pl);
+        case UNIRAST_BPP_64BIT*8 + 4:
+            return decode_raster_t<8, 4, 2>(in, page, pl);
+    }
+
+    return 1;
+}
+
+template<unsigned PixelSize, unsigned Components, unsigned SampleBytes>
+int scan_raster_t(struct urf_input * in, struct pdf_page * page, struct page_scan * scan)
+{
+    page_scanner<pixel_format<PixelSize, Components, SampleBytes, Components, SampleBytes> > out;
+
+    out.neutral = scan->neutral && Components == 3;
+    out.white = scan->white;
+    out.bilevel = scan->bilevel && Components != 4;
+    out.photo = scan->photo;
+    out.whole = scan->whole;
+    out.hash = scan->hash;
+    out.raster_size = 0;
+    out.changes = 0;
+    out.literals = 0;
+    out.photo_literals = (uint64_t)page->urf_width*page->urf_height/PHOTO_LITERALS;
+
+    if(parse_raster_t<PixelSize>(in, page->urf_width, page->urf_height, out) != 0)
+        return 1;
+
+    out.photo = out.photo && out.literals >= out.photo_literals && out.literals > 0;
+    *scan = out;
+
+    return 0;
+}
+
+/*
+ * Page fingerprints for urf-dedup, the XXH64 hash of the raster bytes.
+ * Equal page headers and rasters decode to equal images.
+ */
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME3 0x165667B19E3779F9ULL
+#define HASH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define HASH_PRIME5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t * p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t input)
+{
+    return rotl64(acc + input*HASH_PRIME2, 31)*HASH_PRIME1;
+}
+
+static inline uint64_t hash_merge(uint64_t acc, uint64_t v)
+{
+    return (acc ^ hash_round(0, v))*HASH_PRIME1 + HASH_PRIME4;
+}
+
+uint64_t hash64(const uint8_t * data, size_t size, uint64_t seed)
+{
+    const uint8_t * end = data + size;
+    uint64_t h;
+
+    if(size >= 32)
+    {
+        uint64_t v1 = seed + HASH_PRIME1 + HASH_PRIME2;
+        uint64_t v2 = seed + HASH_PRIME2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - HASH_PRIME1;
+
+        do
+        {
+            v1 = hash_round(v1, read64(data));
+            v2 = hash_round(v2, read64(data + 8));
+            v3 = hash_round(v3, read64(data + 16));
+            v4 = hash_round(v4, read64(data + 24));
+            data += 32;
+        }
+        while(end - data >= 32);
+
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = hash_merge(h, v1);
+        h = hash_merge(h, v2);
+        h = hash_merge(h, v3);
+        h = hash_merge(h, v4);
+    }
+    else
+        h = seed + HASH_PRIME5;
+
+    h += size;
+
+    for( ; end - data >= 8 ; data += 8)
+        h = rotl64(h ^ hash_round(0, read64(data)), 27)*HASH_PRIME1 + HASH_PRIME4;
+    if(end - data >= 4)
+    {
+        uint32_t v;
+
+        memcpy(&v, data, sizeof(v));
+        h = rotl64(h ^ (v*HASH_PRIME1), 23)*HASH_PRIME2 + HASH_PRIME3;
+        data += 4;
+    }
+    for( ; data < end ; ++data)
+        h = rotl64(h ^ (*data*HASH_PRIME5), 11)*HASH_PRIME1;
+
+    h ^= h >> 33;
+    h *= HASH_PRIME2;
+    h ^= h >> 29;
+    h *= HASH_PRIME3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+struct page_fingerprint
+{
+    unsigned number;                    // first page with this raster
+    struct urf_page_header header;
+    const uint8_t * raster;             // in the mapping, NULL for buffered inputs
+};
+
+/*
+ * Raster hash and size of the pages met so far.  A match is only a
+ * duplicate once the bytes compare equal: mapped inputs still hold the
+ * earlier raster, buffered ones only keep a copy of the previous page's.
+ */
+struct page_fingerprints
+{
+    page_fingerprints()
+      : last(-1)
+    {
+    }
+
+    std::map<std::pair<uint64_t, size_t>, struct page_fingerprint> pages;
+    int last;                           // page drawn by the previous page, -1 if none
+    image_buffer raster;                // of the previous page, buffered inputs
+};
+
+// Returns the earlier page with the same header and raster, -1 if none
+int fingerprint_page(struct page_fingerprints * fingerprints, int number, const struct urf_page_header * header,
+                     const uint8_t * raster, size_t size, uint64_t hash, bool mapped)
+{
+    std::pair<std::map<std::pair<uint64_t, size_t>, struct page_fingerprint>::iterator, bool> seen;
+    struct page_fingerprint page;
+    int same_as = -1;
+
+    page.number = number;
+    page.header = *header;
+    page.raster = mapped ? raster : NULL;
+
+    try {
+        seen = fingerprints->pages.insert(std::make_pair(std::make_pair(hash, size), page));
+    } catch (...) {
+        die("Unable to allocate page data");
+    }
+
+    if(!seen.second)
+    {
+        const struct page_fingerprint * first = &seen.first->second;
+        const uint8_t * earlier = first->raster;
+
+        if(earlier == NULL && fingerprints->last == (int)first->number && fingerprints->raster.size() == size)
+            earlier = &fingerprints->raster[0];
+
+        if(earlier == NULL)
+            iprintf("Page %d may repeat page %d, whose raster is no longer kept\n", number, first->number);
+        else if(memcmp(&first->header, header, sizeof(*header)) == 0 && memcmp(earlier, raster, size) == 0)
+            same_as = first->number;
+        else
+            iprintf("Page %d has the fingerprint of page %d but another raster\n", number, first->number);
+    }
+
+    // The copy already holds these bytes when repeating the previous page
+    if(!mapped && !(same_as >= 0 && same_as == fingerprints->last))
+    {
+        try {
+            fingerprints->raster.assign(raster, raster + size);
+        } catch (...) {
+            die("Unable to allocate page data");
+        }
+    }
+    fingerprints->last = (same_as >= 0) ? same_as : number;
+
+    return same_as;
+}
+
+/*
+ * Pre-scan of the page raster.  The input is left at the raster start, or
+ * past the raster of blank pages since they need no decoding.
+ */
+int scan_raster(struct urf_input * in, struct pdf_page * page, struct page_scan * scan)
+{
+    int ret = 1;
+
+    input_mark(in);
+
+    switch(page->bpp*8 + page->urf_components)
+    {
+        case UNIRAST_BPP_8BIT*8 + 1:
+            ret = scan_raster_t<1, 1, 1>(in, page, scan);
+            break;
+        case UNIRAST_BPP_24BIT*8 + 1:
+            ret = scan_raster_t<3, 1, 2>(in, page, scan);
+            break;
+        case UNIRAST_BPP_24BIT*8 + 3:
+            ret = scan_raster_t<3, 3, 1>(in, page, scan);
+            break;
+        case UNIRAST_BPP_32BIT*8 + 1:
+            ret = scan_raster_t<4, 1, 2>(in, page, scan);
+            break;
+        case UNIRAST_BPP_32BIT*8 + 3:
+            ret = scan_raster_t<4, 3, 1>(in, page, scan);
+            break;
+        case UNIRAST_BPP_32BIT*8 + 4:
+            ret = scan_raster_t<4, 4, 1>(in, page, scan);
+            break;
+        case UNIRAST_BPP_64BIT*8 + 1:
+            ret = scan_raster_t<8, 1, 2>(in, page, scan);
+            break;
+        case UNIRAST_BPP_64BIT*8 + 3:
+            ret = scan_raster_t<8, 3, 2>(in, page, scan);
+            break;
+        case UNIRAST_BPP_64BIT*8 + 4:
+            ret = scan_raster_t<8, 4, 2>(in, page, scan);
+            break;
+    }
+
+    if(ret == 0 && scan->whole)
+    {
+        scan->raster_size = in->cur - in->mark;
+        scan->hash = hash64(in->mark, scan->raster_size, scan->hash);
+    }
+
+    if(ret == 0 && scan->white)
+        input_unmark(in);
+    else
+        input_rewind(in);
+
+    return ret;
+}
+
+/*
+ * Reads the next page header and sets up the page from it and from a
+ * pre-scan of its raster, which is consumed for blank pages.  With
+ * fingerprints, the raster of a page repeating an earlier one is skipped
+ * as well.
+ */
+struct pdf_page * read_page(struct urf_input * in, struct urf_options * options, int number, struct page_fingerprints * fingerprints)
+{
+    struct urf_page_header page_header, page_header_orig;
+    struct stage_clock clock;
+
+    stage_start(&clock);
+    if(input_read(in, &page_header_orig, sizeof(page_header_orig)) < sizeof(page_header_orig)) die("Unable to read page header");
+
+    //Transform
+    page_header.bpp = page_header_orig.bpp;
+    page_header.colorspace = page_header_orig.colorspace;
+    page_header.duplex = page_header_orig.duplex;
+    page_header.quality = page_header_orig.quality;
+    page_header.unknown0 = 0;
+    page_header.unknown1 = 0;
+    page_header.width = ntohl(page_header_orig.width);
+    page_header.height = ntohl(page_header_orig.height);
+    page_header.dot_per_inch = ntohl(page_header_orig.dot_per_inch);
+    page_header.unknown2 = 0;
+    page_header.unknown3 = 0;
+
+    iprintf("Page %d :\n", number);
+    iprintf("Bits Per Pixel : %d\n", page_header.bpp);
+    iprintf("Colorspace : %d\n", page_header.colorspace);
+    iprintf("Duplex Mode : %d\n", page_header.duplex);
+    iprintf("Quality : %d\n", page_header.quality);
+    iprintf("Size : %dx%d pixels\n", page_header.width, page_header.height);
+    iprintf("Dots per Inches : %d\n", page_header.dot_per_inch);
+
+    unsigned components = urf_components(page_header.colorspace);
+    if(components == 0)
+    {
+        die("Invalid ColorSpace");
+    }
+
+    if((page_header.bpp != UNIRAST_BPP_8BIT && page_header.bpp != UNIRAST_BPP_24BIT &&
+        page_header.bpp != UNIRAST_BPP_32BIT && page_header.bpp != UNIRAST_BPP_64BIT) || page_header.bpp/8 < components)
+    {
+        die("Invalid Bit Per Pixel value for this ColorSpace");
+    }
+
+    // Line sizes are computed in 32 bits
+    if((uint64_t)page_header.width*page_header.bpp/8 > MAX_LINE_BYTES)
+    {
+        die("Invalid page width");
+    }
+
+    // Page sizes and resolutions are divided by it
+    if(page_header.dot_per_inch == 0)
+    {
+        die("Invalid resolution");
+    }
+
+    struct pdf_page * pdf_page = NULL;
+    try {
+        pdf_page = new struct pdf_page;
+    } catch (...) {
+        die("Unable to allocate page data");
+    }
+    pdf_page->number = number;
+    pdf_page->width = page_header.width;
+    pdf_page->height = page_header.height;
+    pdf_page->urf_width = page_header.width;
+    pdf_page->urf_height = page_header.height;
+    pdf_page->bpp = page_header.bpp;
+    pdf_page->dpi = page_header.dot_per_inch;
+    pdf_page->colorspace = page_header.colorspace;
+    pdf_page->urf_components = components;
+    pdf_page->components = components;
+    // Pixels with room for two bytes per sample carry 16-bit samples
+    pdf_page->bits = (page_header.bpp/8 >= 2*components && options->keep_16bit && options->output != OUTPUT_PCLM) ? 16 : 8;
+    pdf_page->urf_duplex = page_header.duplex;
+    pdf_page->urf_quality = page_header.quality;
+    pdf_page->blank = false;
+    pdf_page->same_as = -1;
+    pdf_page->encoder = NULL;
+
+    // PWG Raster pages keep their resolution and 8 or 16 bits, PCLm pages are 8-bit gray or RGB
+    bool pwg = (options->output == OUTPUT_PWG);
+    bool pclm = (options->output == OUTPUT_PCLM);
+    struct page_scan scan;
+    scan.neutral = (pdf_page->components == 3 && options->gray == GRAY_AUTO);
+    // White pages are decoded too for the strips of PCLm and the rows callback
+    scan.white = !pclm && !options->rows;
+    scan.bilevel = (!pwg && !pclm && options->bilevel != BILEVEL_NEVER && (pdf_page->components == 1 || options->gray != GRAY_NEVER));
+    scan.photo = (!pwg && options->jpeg == JPEG_AUTO);
+    scan.whole = (fingerprints != NULL);
+    scan.hash = hash64((const uint8_t *)&page_header_orig, sizeof(page_header_orig), 0);
+    stage_stop(&clock, STAGE_HEADER);
+    stage_start(&clock);
+    // The page is not on the pipeline yet
+    try {
+        if(scan_raster(in, pdf_page, &scan) != 0)
+            die("Failed to decode Page");
+        if(fingerprints && !scan.white)
         {
-            if(read(fd, &packbit_code, 1) < 1)
+            pdf_page->same_as = fingerprint_page(fingerprints, number, &page_header_orig, in->cur, scan.raster_size,
+                                                 scan.hash, in->map != NULL);
+            if(pdf_page->same_as >= 0)
             {
-                dprintf("p%06dl%06d : packbit_code EOF at %lu\n", pos, cur_line, lseek(fd, 0, SEEK_CUR));
-                return 1;
+                if(!input_skip(in, scan.raster_size)) die("Failed to decode Page");
+                iprintf("Page %d is the same as page %d\n", number, pdf_page->same_as);
             }
+        }
+    } catch (...) {
+        delete pdf_page;
+        throw;
+    }
+    stage_stop(&clock, STAGE_SCAN);
+    pdf_page->blank = scan.white;
 
-            dprintf("p%06dl%06d: Raster code %02X='%d'.\n", pos, cur_line, (uint8_t)packbit_code, packbit_code);
+    if(pdf_page->components == 3 && options->gray != GRAY_NEVER)
+    {
+        if(options->gray == GRAY_ALWAYS)
+            pdf_page->components = 1;
+        else if(scan.neutral && !scan.white && !scan.bilevel)
+        {
+            iprintf("Page %d has no color, storing it as gray\n", number);
+            pdf_page->components = 1;
+        }
+    }
+    if(pclm && pdf_page->components == 4)
+        pdf_page->components = 3;
+    pdf_page->encoding = options->encoding;
+    if(pwg)
+        pdf_page->encoding = ENCODING_PWG;
+    else if(pclm && pdf_page->encoding == ENCODING_RLE_FLATE)
+        pdf_page->encoding = ENCODING_FLATE;
+    // Bands then hold the raw rows
+    if(options->rows && rle_encoding(pdf_page->encoding))
+        pdf_page->encoding = ENCODING_FLATE;
+    if(scan.bilevel && !scan.white)
+    {
+        pdf_page->components = 1;
+        pdf_page->bits = 1;
+        // Dithered pages have too many short runs for G4
+        if(options->bilevel == BILEVEL_CCITT && scan.changes*G4_MIN_RUN <= (uint64_t)page_header.width*page_header.height)
+            pdf_page->encoding = ENCODING_CCITT;
+        else
+            pdf_page->encoding = ENCODING_FLATE;
+        iprintf("Page %d is black and white, storing it as 1-bit %s\n", number,
+                (pdf_page->encoding == ENCODING_CCITT) ? "CCITT G4" : "Flate");
+    }
+    pdf_page->quality = options->compression_level;
+    if(options->compression_level == DEFLATE_LEVEL_ADAPTIVE)
+        pdf_page->quality = tuner->level;
+    // 8-bit gray and RGB only, readers do not agree on the inversion of CMYK JPEGs
+    if(!pwg && pdf_page->bits == 8 && pdf_page->components != 4 && !scan.white &&
+       (options->jpeg == JPEG_ALWAYS || (options->jpeg == JPEG_AUTO && scan.photo)))
+    {
+        pdf_page->encoding = ENCODING_DCT;
+        pdf_page->quality = options->jpeg_quality;
+        if(options->jpeg == JPEG_AUTO)
+            iprintf("Page %d looks like a photo, storing it as JPEG\n", number);
+    }
+    pdf_page->downsample = 1;
+    if(!pwg && options->max_dpi && page_header.dot_per_inch > options->max_dpi && !scan.white)
+    {
+        unsigned factor = (page_header.dot_per_inch + options->max_dpi - 1)/options->max_dpi;
 
-            if(packbit_code == -128)
-            {
-                dprintf("\tp%06dl%06d : blank rest of line.\n", pos, cur_line);
-                memset((&line_container[pos*pixel_size]), 0xFF, (pixel_size*(width-pos)));
-                pos = width;
-                break;
-            }
-            else if(packbit_code >= 0 && packbit_code <= 127)
+        if(factor > MAX_DOWNSAMPLE)
+            factor = MAX_DOWNSAMPLE;
+        pdf_page->downsample = factor;
+        pdf_page->width = (page_header.width + factor - 1)/factor;
+        pdf_page->height = (page_header.height + factor - 1)/factor;
+        // Averaged pixels leave no URF runs to transcode
+        if(rle_encoding(pdf_page->encoding))
+            pdf_page->encoding = ENCODING_FLATE;
+        iprintf("Page %d is downsampled from %d to %d dpi\n", number, page_header.dot_per_inch, page_header.dot_per_inch/factor);
+    }
+    pdf_page->line_bytes = (pdf_page->width*pdf_page->components*pdf_page->bits + 7)/8;
+    // Predictors only apply to Flate alone, PCLm has no DecodeParms
+    pdf_page->predictor = (pdf_page->encoding == ENCODING_FLATE && !pclm) ? options->predictor : PREDICTOR_OFF;
+    pdf_page->strip_lines = 0;
+    if(pclm)
+        pdf_page->strip_lines = options->pclm_strip_height;
+    else if(options->threads > 1)
+    {
+        unsigned strips = options->threads*STRIPS_PER_THREAD;
+        pdf_page->strip_lines = (pdf_page->height + strips - 1)/strips;
+        if(pdf_page->strip_lines < MIN_STRIP_LINES)
+            pdf_page->strip_lines = MIN_STRIP_LINES;
+    }
+
+    return pdf_page;
+}
+
+// Queue the raster of a page set up by read_page() on the pipeline
+void decode_page(struct urf_input * in, struct pdf_page * pdf_page, struct pipeline * pl)
+{
+    struct stage_clock clock;
+
+    // The page belongs to the pipeline once its last band is queued
+    if(stats->enabled)
+    {
+        stats->pages++;
+        if(pdf_page->blank)
+            stats->blank_pages++;
+        else if(pdf_page->same_as >= 0)
+            stats->duplicate_pages++;
+        else
+            stats->raster_bytes += (uint64_t)pdf_page->line_bytes*pdf_page->height;
+    }
+
+    stage_start(&clock);
+    if(!page_has_raster(pdf_page))
+    {
+        // Nothing to encode, the page only needs its MediaBox or the images of same_as
+        if(pdf_page->blank)
+            iprintf("Page %d is blank\n", pdf_page->number);
+        struct raster_band * band = band_new(pl, pdf_page, 0);
+        band->last = true;
+        band_push(pl, band);
+    }
+    else if(decode_raster(in, pdf_page, pl) != 0)
+        die("Failed to decode Page");
+    stage_stop(&clock, STAGE_DECODE);
+
+    input_release(in);
+}
+
+//------------- Page mode ---------------
+
+// Walks a raster without looking at the pixels
+struct raster_skipper
+{
+    void begin_line() {}
+    void blank(unsigned, unsigned) {}
+    void repeat(unsigned, const uint8_t *, unsigned) {}
+    void copy(unsigned, const uint8_t *, unsigned) {}
+    bool end_line(unsigned) { return true; }
+};
+
+/*
+ * Index pass: skips over the next page and returns the earlier page it
+ * repeats, -1 if none or without fingerprints.  The page header is checked
+ * by read_page() later on.
+ */
+int index_page(struct urf_input * in, int number, struct page_fingerprints * fingerprints)
+{
+    struct urf_page_header header;
+    struct raster_skipper skip;
+    const uint8_t * raster;
+    unsigned width, height;
+    int ret = 1;
+
+    if(input_read(in, &header, sizeof(header)) < sizeof(header)) die("Unable to read page header");
+    width = ntohl(header.width);
+    height = ntohl(header.height);
+    raster = in->cur;
+
+    switch(header.bpp)
+    {
+        case UNIRAST_BPP_8BIT:
+            ret = parse_raster_t<1>(in, width, height, skip);
+            break;
+        case UNIRAST_BPP_24BIT:
+            ret = parse_raster_t<3>(in, width, height, skip);
+            break;
+        case UNIRAST_BPP_32BIT:
+            ret = parse_raster_t<4>(in, width, height, skip);
+            break;
+        case UNIRAST_BPP_64BIT:
+            ret = parse_raster_t<8>(in, width, height, skip);
+            break;
+        default:
+            die("Invalid Bit Per Pixel value for this ColorSpace");
+    }
+    if(ret != 0) die("Failed to decode Page");
+
+    if(fingerprints == NULL)
+        return -1;
+
+    // Same fingerprint as read_page(), page mode inputs are mapped
+    size_t size = in->cur - raster;
+    uint64_t hash = hash64(raster, size, hash64((const uint8_t *)&header, sizeof(header), 0));
+    int same_as = fingerprint_page(fingerprints, number, &header, raster, size, hash, true);
+
+    if(same_as >= 0)
+        iprintf("Page %d is the same as page %d\n", number, same_as);
+    return same_as;
+}
+
+// Worker job: the page at offset is read, decoded and compressed on the calling thread
+void convert_page(struct pipeline * pl, struct urf_input * in, size_t offset, int number, int same_as, struct pdf_page ** page)
+{
+    struct urf_input view;
+    struct image_encoder * enc = encoder_get(pl);
+
+    input_view(&view, in, offset);
+    try {
+        *page = read_page(&view, pl->options, number, NULL);
+        // Blank pages have nothing to share
+        if(!(*page)->blank)
+            (*page)->same_as = same_as;
+
+        (*page)->encoder = enc;
+        decode_page(&view, *page, pl);
+    } catch (...) {
+        // A page read is still handed to write_stage() by convert_pages(), to be dropped
+        if(*page)
+            (*page)->encoder = NULL;
+        encoder_discard(pl, enc);
+        throw;
+    }
+    (*page)->encoder = NULL;
+
+    encoder_release(pl, enc);
+}
+
+/*
+ * Indexes the pages of a mapped input and converts them on the workers,
+ * at most PIPELINE_PAGES pages ahead of the threads.  sources gets the
+ * page drawn for each page.
+ */
+void convert_pages(struct urf_input * in, unsigned count, struct pipeline * pl, struct page_fingerprints * fingerprints,
+                   std::vector<unsigned> * sources)
+{
+    std::deque<struct pdf_page *> pages;   // grown as indexed, count is not checked
+    std::deque<std::future<void> > converting;
+    std::deque<size_t> offsets;     // of the pages converting
+    unsigned number, done = 0;
+
+    try {
+        for(number = 0 ; number < count || done < count ; )
+        {
+            if(number < count && converting.size() < pl->options->threads + PIPELINE_PAGES)
             {
-                int n = (packbit_code+1);
+                size_t offset = in->cur - in->map;
+                struct stage_clock clock;
+                int same_as;
 
-                //Read pixel
-                if(read(fd, &pixel_container[0], pixel_size) < pixel_size)
-                {
-                    dprintf("p%06dl%06d : pixel repeat EOF at %lu\n", pos, cur_line, lseek(fd, 0, SEEK_CUR));
-                    return 1;
+                stage_start(&clock);
+                same_as = index_page(in, number, fingerprints);
+                stage_stop(&clock, STAGE_SCAN);
+
+                try {
+                    sources->push_back((same_as >= 0) ? same_as : number);
+                    offsets.push_back(offset);
+                    pages.push_back(NULL);
+                } catch (...) {
+                    die("Unable to allocate page data");
                 }
+                converting.push_back(pl->workers->submit(std::bind(convert_page, pl, in, offset, number, same_as, &pages[number])));
+                ++number;
+                continue;
+            }
 
-                dprintf("\tp%06dl%06d : Repeat pixel '", pos, cur_line);
-                for(j = 0 ; j < pixel_size ; ++j)
-                    dprintf("%02X ", pixel_container[j]);
-                dprintf("' for %d times.\n", n);
+            // Pages are written in order
+            converting.front().get();
+            converting.pop_front();
+            offsets.pop_front();
+            pl->pages.push(pages[done++]);
 
-                for(i = 0 ; i < n ; ++i)
-                {
-                    //for(j = pixel_size-1 ; j >= 0 ; --j)
-                    for(j = 0 ; j < pixel_size ; ++j)
-                        line_container[pixel_size*pos + j] = pixel_container[j];
-                    ++pos;
-                    if(pos >= width)
-                        break;
-                }
+            // Keep the mapping of the pages still converting
+            in->mark = offsets.empty() ? NULL : in->map + offsets.front();
+            input_release(in);
+            in->mark = NULL;
+        }
+    } catch (std::exception & e) {
+        pipeline_fail(pl, e.what());
 
-                if(i < n && pos >= width)
-                {
-                    dprintf("\tp%06dl%06d : Forced end of line for pixel repeat.\n", pos, cur_line);
-                }
-                
-                if(pos >= width)
-                    break;
+        // The workers still use the pages and the mapping
+        for( ; !converting.empty() ; converting.pop_front())
+        {
+            try {
+                if(converting.front().valid())
+                    converting.front().get();
+            } catch (...) {
             }
-            else if(packbit_code > -128 && packbit_code < 0)
+        }
+        for( ; done < number ; ++done)
+            if(pages[done])
+                pl->pages.push(pages[done]);
+        throw;
+    }
+}
+
+//------------- Library ---------------
+
+/*
+ * A job converts one URF document, on a thread of its own when fed by
+ * unirast_job_write().  Its budget, stats, tuner and log are its own, see
+ * struct job_state.
+ */
+struct unirast_job
+{
+    unirast_job()
+      : started(false),
+        status(0),
+        out_bytes(0)
+    {
+    }
+
+    struct unirast_params params;
+    struct urf_options options;
+    struct job_state state;
+    struct urf_feed feed;
+    std::thread decoder;
+    bool started;
+    int status;                 // nonzero once failed
+    std::string error;          // first one
+    uint64_t out_bytes;
+};
+
+#define JOB_OUTPUT_BUFFER (64*1024)
+
+static void job_fail(struct unirast_job * job, const char * error)
+{
+    if(job->status == 0)
+    {
+        try {
+            job->error = error;
+        } catch (...) {
+        }
+    }
+    job->status = 1;
+}
+
+static ssize_t job_output_write(void * cookie, const char * data, size_t size)
+{
+    struct unirast_job * job = (struct unirast_job *)cookie;
+
+    if(job->params.write(job->params.ctx, data, size) != 0)
+        return 0;
+    job->out_bytes += size;
+
+    return size;
+}
+
+// The document goes through stdio to the write callback
+static FILE * job_output_open(struct unirast_job * job)
+{
+    cookie_io_functions_t io = { NULL, job_output_write, NULL, NULL };
+    FILE * out = fopencookie(job, "w", io);
+
+    if(out)
+        setvbuf(out, NULL, _IOFBF, JOB_OUTPUT_BUFFER);
+
+    return out;
+}
+
+static void job_convert(struct unirast_job * job, struct urf_input * in)
+{
+    const struct unirast_params * params = &job->params;
+    struct urf_options * options = &job->options;
+    struct urf_file_header head, head_orig;
+    struct pdf_info pdf;
+    struct pwg_info pwg;
+    struct stage_clock clock;
+    struct page_fingerprints fingerprints;
+    std::vector<unsigned> sources;   // page drawn for each page, for collated copies
+    FILE * out = NULL;
+    unsigned page;
+
+    try {
+        stage_start(&clock);
+        if(input_read(in, &head_orig, sizeof(head_orig)) < sizeof(head_orig)) die("Unable to read file header");
+
+        //Transform
+        memcpy(head.unirast, head_orig.unirast, sizeof(head.unirast));
+        head.page_count = ntohl(head_orig.page_count);
+
+        if(head.unirast[7])
+            head.unirast[7] = 0;
+
+        if(strncmp(head.unirast, "UNIRAST", 7) != 0) die("Bad File Header");
+
+        iprintf("%s file, with %d page(s).\n", head.unirast, head.page_count);
+
+        if(params->write)
+        {
+            // 0 (unknown) when the total does not fit the 32 bits of PWG TotalPageCount
+            uint64_t total = (uint64_t)head.page_count*options->copies;
+            unsigned pagecount = (total > UINT32_MAX) ? 0 : total;
+
+            out = job_output_open(job);
+            if(out == NULL) die("Unable to create output file");
+            if(options->output == OUTPUT_PWG)
             {
-                int n = (-(int)packbit_code)+1;
+                if(create_pwg_file(&pwg, out, pagecount, options) != 0) die("Unable to create PWG Raster file");
+            }
+            else if(create_pdf_file(&pdf, out, pagecount, options->output == OUTPUT_PCLM) != 0)
+                die("Unable to create PDF file");
+        }
+        stage_stop(&clock, STAGE_HEADER);
+    } catch (std::exception & e) {
+        job_fail(job, e.what());
+        if(out)
+            fclose(out);
+        return;
+    }
 
-                dprintf("\tp%06dl%06d : Copy %d verbatim pixels.\n", pos, cur_line, n);
+    struct pipeline pl(params->write ? &pdf : NULL, options);
+    if(options->output == OUTPUT_PWG && params->write)
+        pl.pwg = &pwg;
+    if(params->page || params->rows)
+        pl.callbacks = params;
+    pl.images = (params->write != NULL);
+    struct raster_band * end = band_new(&pl, NULL, 0);
+    std::thread compress_thread(compress_stage, &pl);
+    std::thread write_thread(write_stage, &pl);
 
-                for(i = 0 ; i < n ; ++i)
-                {
-                    if(read(fd, &pixel_container[0], pixel_size) < pixel_size)
-                    {
-                        dprintf("p%06dl%06d : literal_pixel EOF at %lu\n", pos, cur_line, lseek(fd, 0, SEEK_CUR));
-                        return 1;
-                    }
-                    //Invert pixels, should be programmable
-                    for(j = 0 ; j < pixel_size ; ++j)
-                        line_container[pixel_size*pos + j] = pixel_container[j];
-                    ++pos;
-                    if(pos >= width)
-                        break;
-                }
+    try {
+        // Callbacks want the pages one at a time
+        if(in->map && pl.workers && head.page_count > 1 && !pl.callbacks && pl.images)
+            convert_pages(in, head.page_count, &pl, options->dedup ? &fingerprints : NULL, &sources);
+        else
+        {
+            for(page = 0 ; page < head.page_count && !pl.failed ; ++page)
+            {
+                struct pdf_page * pdf_page = read_page(in, options, page, options->dedup ? &fingerprints : NULL);
 
-                if(i < n && pos >= width)
-                {
-                    dprintf("\tp%06dl%06d : Forced end of line for pixel copy.\n", pos, cur_line);
+                try {
+                    sources.push_back((pdf_page->same_as >= 0) ? pdf_page->same_as : page);
+                } catch (...) {
+                    delete pdf_page;
+                    die("Unable to allocate page data");
                 }
-                
-                if(pos >= width)
-                    break;
+                decode_page(in, pdf_page, &pl);
             }
         }
-        while(pos < width);
+    } catch (std::exception & e) {
+        pipeline_fail(&pl, e.what());
+    }
 
-        dprintf("\tl%06d : End Of line, drawing %d times.\n", cur_line, line_repeat);
+    // Drain the pipeline
+    pl.bands.push(end);
+    compress_thread.join();
+    write_thread.join();
 
-        // write lines
-        for(i = 0 ; i < (int)line_repeat ; ++i)
+    try {
+        if(!pl.failed && out)
         {
-            pdf_set_line(info, cur_line, &line_container[0]);
-            ++cur_line;
+            stage_start(&clock);
+            if(options->collate)
+            {
+                unsigned copy, i;
+
+                for(copy = 1 ; copy < options->copies ; ++copy)
+                    for(i = 0 ; i < sources.size() ; ++i)
+                        if(output_page_copy(&pl, sources[i]) != 0) die("Unable to create output file");
+            }
+            if(options->output == OUTPUT_PWG)
+            {
+                if(close_pwg_file(&pwg) != 0) die("Unable to write PWG Raster file");
+            }
+            else if(close_pdf_file(&pdf) != 0)
+                die("Unable to write PDF file");
+            stage_stop(&clock, STAGE_WRITE);
         }
+    } catch (std::exception & e) {
+        pipeline_fail(&pl, e.what());
     }
-    while(cur_line < height);
+    if(out && fclose(out) != 0 && !pl.failed)
+        pipeline_fail(&pl, "Unable to write output file");
 
-    return 0;
+    print_stats(params->job_id, input_tell(in), job->out_bytes);
+
+    if(pl.failed)
+        job_fail(job, pl.error.c_str());
 }
 
-int main(int argc, char **argv)
+// fd is -1 to read the feed
+static void job_run(struct unirast_job * job, int fd)
 {
-    int fd, page;
-    struct urf_file_header head, head_orig;
-    struct urf_page_header page_header, page_header_orig;
-    struct pdf_info pdf;
-#ifdef HPDF_BACKEND
-    char tempfile_name[255];
+    struct job_state * previous = current_job;
+    struct urf_input in;
 
-    memset(&pdf, 0, sizeof(pdf));
-#endif
+    job_enter(&job->state);
+    try {
+        if(((fd >= 0) ? input_open(&in, fd) : input_open_feed(&in, &job->feed)) != 0) die("Unable to open input stream");
+        try {
+            job_convert(job, &in);
+        } catch (std::exception & e) {
+            job_fail(job, e.what());
+        }
+        input_close(&in);
+    } catch (std::exception & e) {
+        job_fail(job, e.what());
+    }
+    job_enter(previous);
 
-    FILE * input = NULL;
+    // Writers waiting on bytes past the last page can go
+    feed_close(&job->feed);
+}
 
-    if(argc < 6)
-    {
-        fprintf(stderr, "Usage: %s <job> <user> <job name> <copies> <option> [file]\n", argv[0]);
+static int job_start(struct unirast_job * job)
+{
+    job->started = true;
+    try {
+        job->decoder = std::thread(job_run, job, -1);
+    } catch (...) {
+        job_fail(job, "Unable to start the job");
+        feed_close(&job->feed);
         return 1;
     }
 
-    if(argc > 6)
-    {
-        input = fopen(argv[6], "rb");
-        if(input == NULL) die("Unable to open unirast file");
+    return 0;
+}
+
+struct unirast_job * unirast_job_new(const struct unirast_params * params)
+{
+    struct job_state * previous = current_job;
+    struct unirast_job * job;
+
+    if(params == NULL || params->output < UNIRAST_OUTPUT_PDF || params->output > UNIRAST_OUTPUT_PCLM)
+        return NULL;
+    // PWG Raster pages are encoded as they are decoded
+    if(params->rows && params->output == UNIRAST_OUTPUT_PWG)
+        return NULL;
+
+    try {
+        job = new unirast_job;
+    } catch (...) {
+        return NULL;
     }
-    else
-        input = stdin;
+    job->state.log = params->log;
+    job->state.log_ctx = params->ctx;
 
-#ifdef HPDF_BACKEND
-    if(cupsTempFile2(tempfile_name, 255) == NULL) die("Unable to create a temporary pdf file");
-    iprintf("Created temporary file '%s'\n", tempfile_name);
-#endif
+    job_enter(&job->state);
+    try {
+        parse_options(&job->options, params->options ? params->options : "");
+    } catch (...) {
+        job_enter(previous);
+        delete job;
+        return NULL;
+    }
+    job_enter(previous);
+    job->params = *params;
+    job->params.options = NULL;
 
-    // Get fd from file
-    fd = fileno(input);
+    job->options.copies = params->copies ? params->copies : 1;
+    job->options.output = (params->output == UNIRAST_OUTPUT_PWG) ? OUTPUT_PWG :
+                          (params->output == UNIRAST_OUTPUT_PCLM) ? OUTPUT_PCLM : OUTPUT_PDF;
+    job->options.rows = (params->rows != NULL);
+    // PWG pages are only written in full, PCLm pages have their own strips and rows are given for every page
+    if(job->options.output != OUTPUT_PDF || job->options.rows)
+        job->options.dedup = false;
 
-    if(read(fd, &head_orig, sizeof(head)) == -1) die("Unable to read file header");
+    job->state.stats.enabled = job->options.stats;
+    job->state.budget.limit = job->options.max_memory;
+    if(job->options.compression_level == DEFLATE_LEVEL_ADAPTIVE)
+        job->state.tuner.budget_ns = (uint64_t)job->options.compression_budget*1000000;
 
-    //Transform
-    memcpy(head.unirast, head_orig.unirast, sizeof(head.unirast));
-    head.page_count = ntohl(head_orig.page_count);
+    return job;
+}
 
-    if(head.unirast[7])
-        head.unirast[7] = 0;
+int unirast_job_write(struct unirast_job * job, const void * data, size_t size)
+{
+    if(!job->started && job_start(job) != 0)
+        return -1;
+    if(feed_write(&job->feed, (const uint8_t *)data, size))
+        return 0;
 
-    if(strncmp(head.unirast, "UNIRAST", 7) != 0) die("Bad File Header");
+    // The decoder is done, bytes past the last page are ignored
+    return job->status ? -1 : 0;
+}
 
-    iprintf("%s file, with %d page(s).\n", head.unirast, head.page_count);
+int unirast_job_finish(struct unirast_job * job)
+{
+    if(!job->started && job_start(job) != 0)
+        return -1;
+    feed_end(&job->feed);
+    if(job->decoder.joinable())
+        job->decoder.join();
 
-#ifdef HPDF_BACKEND
-    if(create_pdf_file(&pdf, tempfile_name, head.page_count) != 0) die("Unable to create PDF file");
-#else
-    if(create_pdf_file(&pdf, head.page_count) != 0) die("Unable to create PDF file");
-#endif
+    return job->status ? -1 : 0;
+}
 
-    for(page = 0 ; page < (int)head.page_count ; ++page)
-    {
-        if(read(fd, &page_header_orig, sizeof(page_header_orig)) == -1) die("Unable to read page header");
+int unirast_job_convert_fd(struct unirast_job * job, int fd)
+{
+    if(job->started)
+        return -1;
+    job->started = true;
+    job_run(job, fd);
 
-        //Transform
-        page_header.bpp = page_header_orig.bpp;
-        page_header.colorspace = page_header_orig.colorspace;
-        page_header.duplex = page_header_orig.duplex;
-        page_header.quality = page_header_orig.quality;
-        page_header.unknown0 = 0;
-        page_header.unknown1 = 0;
-        page_header.width = ntohl(page_header_orig.width);
-        page_header.height = ntohl(page_header_orig.height);
-        page_header.dot_per_inch = ntohl(page_header_orig.dot_per_inch);
-        page_header.unknown2 = 0;
-        page_header.unknown3 = 0;
+    return job->status ? -1 : 0;
+}
 
-        iprintf("Page %d :\n", page);
-        iprintf("Bits Per Pixel : %d\n", page_header.bpp);
-        iprintf("Colorspace : %d\n", page_header.colorspace);
-        iprintf("Duplex Mode : %d\n", page_header.duplex);
-        iprintf("Quality : %d\n", page_header.quality);
-        iprintf("Size : %dx%d pixels\n", page_header.width, page_header.height);
-        iprintf("Dots per Inches : %d\n", page_header.dot_per_inch);
+const char * unirast_job_error(struct unirast_job * job)
+{
+    return job->status ? job->error.c_str() : NULL;
+}
 
-        if(page_header.colorspace != UNIRAST_COLOR_SPACE_SRGB_24BIT_1 && page_header.colorspace != UNIRAST_COLOR_SPACE_GRAYSCALE_8BIT)
-        {
-            die("Invalid ColorSpace, currently only RGB 24BIT type 1 and Grayscale 8BIT are supported");
-        }
-        
-        if(page_header.bpp != UNIRAST_BPP_24BIT && page_header.bpp != UNIRAST_BPP_8BIT)
-        {
-            die("Invalid Bit Per Pixel value, only 24bit and 8bit are supported");
-        }
+void unirast_job_free(struct unirast_job * job)
+{
+    if(job == NULL)
+        return;
+    if(job->decoder.joinable())
+    {
+        feed_end(&job->feed);
+        job->decoder.join();
+    }
+    delete job;
+}
 
-        if(add_pdf_page(&pdf, page, page_header.width, page_header.height, page_header.bpp, page_header.dot_per_inch, page_header.colorspace) != 0)
-            die("Unable to create PDF file");
+// The benchmarks and the library include this file without the filter
+#ifndef URFTOPDF_NO_MAIN
+static int stdout_write(void * ctx, const void * data, size_t size)
+{
+    const char * cur = (const char *)data;
 
-        if(decode_raster(fd, page_header.width, page_header.height, page_header.bpp, &pdf) != 0)
-            die("Failed to decode Page");
+    while(size > 0)
+    {
+        ssize_t ret = write(STDOUT_FILENO, cur, size);
+
+        if(ret < 0 && errno == EINTR)
+            continue;
+        if(ret <= 0)
+            return 1;
+        cur += ret;
+        size -= ret;
     }
 
-    close_pdf_file(&pdf);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct unirast_params params;
+    struct unirast_job * job;
+    int fd = STDIN_FILENO, ret;
 
-#ifdef HPDF_BACKEND
-    // output generated file
+    if(argc < 6)
     {
-        uint8_t * buffer[4096];
-        size_t sread = 4096;
-        int file = open(tempfile_name, O_RDONLY);
-        if(file == -1) die("Unable to read back temporary file");
+        fprintf(stderr, "Usage: %s <job> <user> <job name> <copies> <option> [file]\n", argv[0]);
+        return 1;
+    }
 
-        while(sread > 0)
+    memset(&params, 0, sizeof(params));
+    params.options = argv[5];
+    params.copies = (atoi(argv[4]) > 1) ? atoi(argv[4]) : 1;
+    params.job_id = strtoul(argv[1], NULL, 10);
+    params.write = stdout_write;
+    params.log = log_stderr;
+
+    // Installed as urftopwg for image/urf to image/pwg-raster and urftopclm for application/PCLm
+    const char * name = strrchr(argv[0], '/');
+    name = name ? name + 1 : argv[0];
+    if(strcmp(name, "urftopwg") == 0)
+        params.output = UNIRAST_OUTPUT_PWG;
+    else if(strcmp(name, "urftopclm") == 0)
+        params.output = UNIRAST_OUTPUT_PCLM;
+
+    if(argc > 6)
+    {
+        fd = open(argv[6], O_RDONLY);
+        if(fd < 0)
         {
-            sread = read(file, buffer, 4096);
-            fwrite(buffer, sread, 1, stdout);
+            fprintf(stderr, "CRIT: (" PROGRAM ") die(Unable to open unirast file) [%m]\n");
+            return 1;
         }
-
-        close(file);
     }
 
-    unlink(tempfile_name);
-#endif
+    job = unirast_job_new(&params);
+    if(job == NULL)
+    {
+        fprintf(stderr, "CRIT: (" PROGRAM ") die(Unable to create job) [%m]\n");
+        return 1;
+    }
+    ret = unirast_job_convert_fd(job, fd);
+    unirast_job_free(job);
 
-    return 0;
+    return ret ? 1 : 0;
 }
+#endif